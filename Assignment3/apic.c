@@ -7,6 +7,9 @@
 #include <msr.h>
 #include <apic.h>
 #include <printf.h>
+#include <timer.h>
+#include <task.h>
+#include <trace.h>
 
 static void *lapic_base = NULL;
 
@@ -135,16 +138,80 @@ x86_lapic_enable(void)
 	x86_lapic_write(X86_LAPIC_TPR, 0x00U);
 }
 
-void apic_init()
+/* The timer itself is driven by timer.c */
+void
+apic_timer_setup(uint32_t vector, uint32_t mode)
+{
+	x86_lapic_write(X86_LAPIC_TIMER, vector | mode);
+	if (mode != APIC_TIMER_TSC_DEADLINE)
+		x86_lapic_write(X86_LAPIC_TIMER_DIVIDE, 0xB); /* divide by 1 */
+}
+
+/* One-shot count, 0 stops the timer */
+void
+apic_timer_oneshot(uint32_t count)
+{
+	x86_lapic_write(X86_LAPIC_TIMER_INIT, count);
+}
+
+/* Absolute TSC deadline, 0 stops the timer */
+void
+apic_timer_deadline(uint64_t tsc)
+{
+	/* Order the MSR write after the LVT setup (Intel SDM 10.5.4.1) */
+	__asm__ __volatile__("mfence; lfence" ::: "memory");
+	wrmsr(X86_MSR_TSC_DEADLINE, tsc);
+}
+
+uint32_t
+apic_timer_current(void)
+{
+	return x86_lapic_read(X86_LAPIC_TIMER_CUR);
+}
+
+uint32_t
+apic_read_id(void)
+{
+	return x86_lapic_read_id();
+}
+
+/* INIT, level assert, to all excluding self */
+void
+apic_broadcast_init(void)
 {
-	x86_lapic_write(X86_LAPIC_TIMER, 40|0x00020000);
-	x86_lapic_write(X86_LAPIC_TIMER_DIVIDE, 0xA);
-	x86_lapic_write(X86_LAPIC_TIMER_INIT, 0x400000);
+	x86_lapic_write_icr(0x000C4500U);
+}
 
+/* STARTUP to all excluding self; the APs start at vector * 4KB in real mode */
+void
+apic_broadcast_startup(uint32_t vector)
+{
+	x86_lapic_write_icr(0x000C4600U | (vector & 0xFFU));
+}
+
+void
+apic_send_ipi(uint32_t apic_id, uint32_t vector)
+{
+	if (lapic_base == X86_LAPIC_X2APIC) {
+		x86_x2apic_write_icr(vector & 0xFFU, apic_id);
+		return;
+	}
+	x86_lapic_write(X86_LAPIC_ICR_HIGH, apic_id << 24);
+	x86_lapic_write_icr(vector & 0xFFU);
+}
+
+/* Nothing to do: the interrupt itself woke the CPU from hlt */
+void
+apic_ipi_handler(void)
+{
+	trace(TRACE_IRQ, APIC_IPI_VECTOR, 0);
+	x86_lapic_write(X86_LAPIC_EOI, 0);
 }
 
 void apic_handler()
 {
-	printf("Timer!\n");
+	trace(TRACE_IRQ, TIMER_VECTOR, 0);
 	x86_lapic_write(X86_LAPIC_EOI, 0);
+	timer_interrupt();
+	sched_preempt();
 }
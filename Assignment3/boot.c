@@ -8,18 +8,81 @@
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/GraphicsOutput.h>
 #include <Guid/FileInfo.h>
+#include <Guid/Acpi.h>
+
+#include "kerninc/bootinfo.h"
 
 /* Use GUID names 'gEfi...' that are already declared in Protocol headers. */
 EFI_GUID gEfiLoadedImageProtocolGuid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
 EFI_GUID gEfiSimpleFileSystemProtocolGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
 EFI_GUID gEfiGraphicsOutputProtocolGuid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
 EFI_GUID gEfiFileInfoGuid = EFI_FILE_INFO_ID;
+EFI_GUID gEfiAcpi20TableGuid = EFI_ACPI_20_TABLE_GUID;
+EFI_GUID gEfiAcpiTableGuid = ACPI_TABLE_GUID;
+
+/*
+ * Pages for the kernel's identity page table (see setup_kernel_pagetable):
+ * 2048 PT + 4 PD + 1 PDP + 1 PML4 with 4KB pages,
+ * 1 PT + 4 PD + 1 PDP + 1 PML4 (at most) with 2MB/1GB pages.
+ */
+#ifdef KERNEL_PT_4K
+# define KERNEL_PT_PAGES 2054
+#else
+# define KERNEL_PT_PAGES 7
+#endif
+
+/* The subset of ELF64 needed to load the kernel */
+#define ELF_MAGIC		0x464C457F	/* "\177ELF" */
+#define ELFCLASS64		2
+#define ELFDATA2LSB		1
+#define ET_EXEC			2
+#define ET_DYN			3
+#define EM_X86_64		62
+#define PT_LOAD			1
+#define PT_DYNAMIC		2
+#define DT_NULL			0
+#define DT_RELA			7
+#define DT_RELASZ		8
+#define DT_RELAENT		9
+#define R_X86_64_NONE		0
+#define R_X86_64_RELATIVE	8
+
+typedef struct {
+	UINT32 e_magic;
+	UINT8 e_class, e_data, e_version, e_osabi;
+	UINT8 e_pad[8];
+	UINT16 e_type, e_machine;
+	UINT32 e_version2;
+	UINT64 e_entry, e_phoff, e_shoff;
+	UINT32 e_flags;
+	UINT16 e_ehsize, e_phentsize, e_phnum;
+	UINT16 e_shentsize, e_shnum, e_shstrndx;
+} ELF64_EHDR;
+
+typedef struct {
+	UINT32 p_type, p_flags;
+	UINT64 p_offset, p_vaddr, p_paddr;
+	UINT64 p_filesz, p_memsz, p_align;
+} ELF64_PHDR;
+
+typedef struct {
+	INT64 d_tag;
+	UINT64 d_val;
+} ELF64_DYN;
+
+typedef struct {
+	UINT64 r_offset, r_info;
+	INT64 r_addend;
+} ELF64_RELA;
 
 /* Keep these variables global. */
 static EFI_HANDLE ImageHandle;
 static EFI_SYSTEM_TABLE *SystemTable;
 static EFI_BOOT_SERVICES *BootServices;
 
+/* Passed to the kernel; lives in the boot loader's image (EfiLoaderCode) */
+static struct boot_info BootInfo;
+
 static VOID *AllocatePool(UINTN size, EFI_MEMORY_TYPE type)
 {
 	VOID *ptr;
@@ -46,23 +109,81 @@ static VOID FreePool(VOID *buf)
 	BootServices->FreePool(buf);
 }
 
-static EFI_STATUS OpenFile(EFI_FILE_PROTOCOL **pvh, EFI_FILE_PROTOCOL **pfh, UINTN num)
+static VOID LoadError(CHAR16 *msg)
+{
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, msg);
+	BootServices->Stall(5 * 1000000);
+}
+
+static VOID Print(CHAR16 *msg)
+{
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, msg);
+}
+
+static VOID PrintNum(UINT64 num)
+{
+	CHAR16 buf[21], *cur = &buf[20];
+
+	*cur = 0;
+	do {
+		*--cur = L'0' + num % 10;
+		num /= 10;
+	} while (num != 0);
+	Print(cur);
+}
+
+static UINT64 ReadTsc(VOID)
+{
+	UINT32 lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((UINT64)hi << 32) | lo;
+}
+
+/* TSC ticks per millisecond, measured across a 1ms Stall() */
+static UINT64 TscKhz(VOID)
+{
+	UINT64 start = ReadTsc();
+
+	BootServices->Stall(1000);
+	return ReadTsc() - start;
+}
+
+static VOID Checkpoint(UINTN stage)
+{
+	BootInfo.boot_tsc[stage] = ReadTsc();
+}
+
+/* "NAME: packed -> size bytes, read N us, decompress N us" */
+static VOID PrintLoadTimes(CHAR16 *name, UINTN packed, UINTN size,
+						   UINT64 read, UINT64 expand, UINT64 tsc_khz)
+{
+	Print(name);
+	Print(L": ");
+	PrintNum(packed);
+	Print(L" -> ");
+	PrintNum(size);
+	Print(L" bytes, read ");
+	PrintNum(read * 1000 / tsc_khz);
+	Print(L" us, decompress ");
+	PrintNum(expand * 1000 / tsc_khz);
+	Print(L" us\r\n");
+}
+
+/* The root directory of the volume the boot loader came from */
+static EFI_STATUS OpenVolume(EFI_FILE_PROTOCOL **pvh)
 {
 	EFI_LOADED_IMAGE *li = NULL;
 	EFI_FILE_IO_INTERFACE *fio = NULL;
-	EFI_FILE_PROTOCOL *vh;
 	EFI_STATUS efi_status;
 
 	*pvh = NULL;
-	*pfh = NULL;
 
 	efi_status = BootServices->HandleProtocol(ImageHandle,
 											  &gEfiLoadedImageProtocolGuid, (void **)&li);
 	if (EFI_ERROR(efi_status))
 	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Cannot get LoadedImage for BOOTx64.EFI\r\n");
-										  BootServices->Stall(5 * 1000000);
+		LoadError(L"Cannot get LoadedImage for BOOTx64.EFI\r\n");
 		return efi_status;
 	}
 
@@ -70,47 +191,19 @@ static EFI_STATUS OpenFile(EFI_FILE_PROTOCOL **pvh, EFI_FILE_PROTOCOL **pfh, UIN
 											  &gEfiSimpleFileSystemProtocolGuid, (void **)&fio);
 	if (EFI_ERROR(efi_status))
 	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Cannot get fio\r\n");
-										  BootServices->Stall(5 * 1000000);
+		LoadError(L"Cannot get fio\r\n");
 		return efi_status;
 	}
 
 	efi_status = fio->OpenVolume(fio, pvh);
 	if (EFI_ERROR(efi_status))
 	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Cannot get the volume handle!\r\n");
-										  BootServices->Stall(5 * 1000000);
-		return efi_status;
-	}
-	vh = *pvh;
-	if(num==0){   // read kernel file
-		efi_status = vh->Open(vh, pfh, L"\\EFI\\BOOT\\KERNEL",
-						  EFI_FILE_MODE_READ, 0);
-	}
-	else if(num==1){  //read user file
-		efi_status = vh->Open(vh, pfh, L"\\EFI\\BOOT\\USER",
-						  EFI_FILE_MODE_READ, 0);
-	}
-	
-	if (EFI_ERROR(efi_status))
-	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Cannot get the file handle!\r\n");
-										  BootServices->Stall(5 * 1000000);
+		LoadError(L"Cannot get the volume handle!\r\n");
 		return efi_status;
 	}
-
 	return EFI_SUCCESS;
 }
 
-static void CloseFile(EFI_FILE_PROTOCOL *vh, EFI_FILE_PROTOCOL *fh)
-{
-	vh->Close(vh);
-	fh->Close(fh);
-}
-
 static UINT32 *SetGraphicsMode(UINT32 width, UINT32 height)
 {
 	EFI_GRAPHICS_OUTPUT_PROTOCOL *graphics;
@@ -171,59 +264,537 @@ static UINT32 *SetGraphicsMode(UINT32 width, UINT32 height)
 		}
 
 		
+		// Describe the mode to the kernel
+		BootInfo.fb_base = graphics->Mode->FrameBufferBase;
+		BootInfo.fb_size = graphics->Mode->FrameBufferSize;
+		BootInfo.fb_width = info->HorizontalResolution;
+		BootInfo.fb_height = info->VerticalResolution;
+		BootInfo.fb_pitch = info->PixelsPerScanLine;
+		BootInfo.fb_format = BOOT_FB_BGRX;
+
 		// Return the frame buffer base address
 		return (UINT32 *)graphics->Mode->FrameBufferBase;
 	}
 	return NULL;
 }
 
-static VOID *LoadFile(EFI_FILE_PROTOCOL *fh, UINTN* size)
+static BOOLEAN SameGuid(EFI_GUID *a, EFI_GUID *b)
+{
+	UINT8 *x = (UINT8 *)a, *y = (UINT8 *)b;
+	UINTN i;
+
+	for (i = 0; i < sizeof(EFI_GUID); i++)
+	{
+		if (x[i] != y[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* The ACPI RSDP from the configuration table, preferring ACPI 2.0+ */
+static UINT64 FindRsdp(VOID)
 {
+	UINT64 rsdp = 0;
+	UINTN i;
+
+	for (i = 0; i < SystemTable->NumberOfTableEntries; i++)
+	{
+		EFI_CONFIGURATION_TABLE *t = &SystemTable->ConfigurationTable[i];
+
+		if (SameGuid(&t->VendorGuid, &gEfiAcpi20TableGuid))
+			return (UINT64)t->VendorTable;
+		if (SameGuid(&t->VendorGuid, &gEfiAcpiTableGuid))
+			rsdp = (UINT64)t->VendorTable;
+	}
+	return rsdp;
+}
+
+static VOID AddModule(CHAR8 *name, VOID *base, UINTN size)
+{
+	struct boot_module *m;
+	UINTN i;
+
+	if (BootInfo.nr_modules == BOOT_MAX_MODULES)
+		return;
+	m = &BootInfo.modules[BootInfo.nr_modules++];
+	m->base = (UINT64)base;
+	m->size = size;
+	for (i = 0; name[i] && i < sizeof(m->name) - 1; i++)
+		m->name[i] = name[i];
+	m->name[i] = 0;
+}
 
+/*
+ * Files are read in READ_CHUNK pieces into page-aligned buffers. When the
+ * file system implements EFI_FILE_PROTOCOL revision 2, the chunks are
+ * queued with ReadEx() and the boot loader keeps working while they
+ * complete (see PollRead); otherwise they are read synchronously.
+ */
+#define READ_CHUNK		(1024 * 1024)
+
+typedef struct {
+	EFI_FILE_PROTOCOL *fh;
+	UINT8 *buffer;
+	UINTN size;			// of the file
+	UINTN offset;		// bytes read so far
+	BOOLEAN pending;	// a ReadEx() is in flight
+	EFI_STATUS status;
+	EFI_FILE_IO_TOKEN token;
+} FILE_READ;
+
+/* Opens 'name' and allocates a buffer for all of it */
+static EFI_STATUS OpenRead(EFI_FILE_PROTOCOL *vh, CHAR16 *name,
+						   EFI_MEMORY_TYPE type, FILE_READ *fr)
+{
+	UINT64 info_buf[(SIZE_OF_EFI_FILE_INFO + 64 * sizeof(CHAR16)) / sizeof(UINT64)];
+	EFI_FILE_INFO *file_info = (EFI_FILE_INFO *)info_buf;
+	UINTN info_size = sizeof(info_buf);
 	EFI_STATUS efi_status;
-	EFI_FILE_INFO *file_info = NULL;
-	VOID *buffer = NULL;
 
-	//Read the file info size.
-	efi_status = fh->GetInfo(fh, &gEfiFileInfoGuid, size, NULL);
+	BootServices->SetMem(fr, sizeof(*fr), 0);
+
+	efi_status = vh->Open(vh, &fr->fh, name, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(efi_status))
+	{
+		LoadError(L"Cannot get the file handle!\r\n");
+		return efi_status;
+	}
+
+	// One GetInfo() suffices for file names up to 64 characters
+	efi_status = fr->fh->GetInfo(fr->fh, &gEfiFileInfoGuid, &info_size, file_info);
 	if (efi_status == EFI_BUFFER_TOO_SMALL)
 	{
-		file_info = AllocatePool(*size, EfiBootServicesData);
+		file_info = AllocatePool(info_size, EfiBootServicesData);
+		if (file_info)
+			efi_status = fr->fh->GetInfo(fr->fh, &gEfiFileInfoGuid, &info_size, file_info);
+		else
+			efi_status = EFI_OUT_OF_RESOURCES;
 	}
-	else
+	if (!EFI_ERROR(efi_status))
+		fr->size = file_info->FileSize;
+	if (file_info && file_info != (EFI_FILE_INFO *)info_buf)
+		FreePool(file_info);
+	if (EFI_ERROR(efi_status))
 	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Cannot get file size.\r\n");
-		BootServices->Stall(5 * 1000000); 
+		LoadError(L"Cannot get the file info.\r\n");
+		fr->fh->Close(fr->fh);
+		return efi_status;
+	}
+
+	fr->buffer = AllocatePages(EFI_SIZE_TO_PAGES(fr->size), type);
+	if (!fr->buffer && fr->size)
+	{
+		LoadError(L"Cannot allocate memory for the file.\r\n");
+		fr->fh->Close(fr->fh);
+		return EFI_OUT_OF_RESOURCES;
 	}
+	return EFI_SUCCESS;
+}
+
+static UINTN NextChunk(FILE_READ *fr)
+{
+	UINTN left = fr->size - fr->offset;
+
+	return left < READ_CHUNK ? left : READ_CHUNK;
+}
+
+/* Queues the next chunk; returns FALSE if ReadEx() refused it */
+static BOOLEAN QueueChunk(FILE_READ *fr)
+{
+	EFI_STATUS efi_status;
+
+	fr->token.Status = EFI_SUCCESS;
+	fr->token.BufferSize = NextChunk(fr);
+	fr->token.Buffer = fr->buffer + fr->offset;
+	efi_status = fr->fh->ReadEx(fr->fh, &fr->token);
+	if (EFI_ERROR(efi_status))
+		return FALSE;
+	fr->pending = TRUE;
+	return TRUE;
+}
 
-	efi_status = fh->GetInfo(fh, &gEfiFileInfoGuid, size, file_info);
+/* Starts reading the file in the background if the firmware can */
+static VOID StartRead(FILE_READ *fr)
+{
+	EFI_STATUS efi_status;
+
+	if (fr->fh->Revision < EFI_FILE_PROTOCOL_REVISION2 || fr->size == 0)
+		return;
+	efi_status = BootServices->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &fr->token.Event);
 	if (EFI_ERROR(efi_status))
+		return;
+	if (!QueueChunk(fr))
 	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Cannot get the file info.\r\n");
-		BootServices->Stall(5 * 1000000); 
+		BootServices->CloseEvent(fr->token.Event);
+		fr->token.Event = NULL;
+	}
+}
+
+/* Collects a completed chunk and queues the next one, never blocks */
+static VOID PollRead(FILE_READ *fr)
+{
+	if (!fr->pending || BootServices->CheckEvent(fr->token.Event) != EFI_SUCCESS)
+		return;
+	fr->pending = FALSE;
+	if (EFI_ERROR(fr->token.Status) || fr->token.BufferSize == 0)
+	{
+		fr->status = EFI_ERROR(fr->token.Status) ? fr->token.Status : EFI_LOAD_ERROR;
+		return;
+	}
+	fr->offset += fr->token.BufferSize;
+	if (fr->offset < fr->size)
+		QueueChunk(fr);	// if refused, FinishRead() reads the rest
+}
+
+/* Completes the read, synchronously for whatever was not queued */
+static EFI_STATUS FinishRead(FILE_READ *fr)
+{
+	EFI_STATUS efi_status;
+	UINTN index;
+
+	while (fr->pending)
+	{
+		BootServices->WaitForEvent(1, &fr->token.Event, &index);
+		PollRead(fr);
+	}
+	if (fr->token.Event)
+		BootServices->CloseEvent(fr->token.Event);
+	fr->token.Event = NULL;
+
+	while (fr->offset < fr->size && !EFI_ERROR(fr->status))
+	{
+		UINTN chunk = NextChunk(fr);
+
+		efi_status = fr->fh->Read(fr->fh, &chunk, fr->buffer + fr->offset);
+		if (EFI_ERROR(efi_status) || chunk == 0)
+			fr->status = EFI_ERROR(efi_status) ? efi_status : EFI_LOAD_ERROR;
+		fr->offset += chunk;
+	}
+
+	fr->fh->Close(fr->fh);
+	if (EFI_ERROR(fr->status))
+		LoadError(L"Error while reading file.\r\n");
+	return fr->status;
+}
+
+/*
+ * LZ4 frame decompression (https://github.com/lz4/lz4/blob/dev/doc), for
+ * images compressed by make.sh with 'lz4 --content-size'. The output goes
+ * straight into its final buffer, so linked blocks need no extra window.
+ * Checksums are skipped: the FAT image is not the place to catch bit rot.
+ */
+#define LZ4_MAGIC			0x184D2204
+#define LZ4_FLG_VERSION		0xC0
+#define LZ4_FLG_BLOCK_CSUM	0x10
+#define LZ4_FLG_SIZE		0x08
+#define LZ4_FLG_CONTENT_CSUM	0x04
+#define LZ4_FLG_DICT_ID		0x01
+#define LZ4_UNCOMPRESSED	0x80000000U
+#define LZ4_MIN_MATCH		4
+
+static UINT32 Get32(const UINT8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT64 Get64(const UINT8 *p)
+{
+	return Get32(p) | ((UINT64)Get32(p + 4) << 32);
+}
+
+static BOOLEAN IsLZ4(const VOID *buf, UINTN size)
+{
+	return size >= 7 && Get32(buf) == LZ4_MAGIC;
+}
+
+/* The decompressed size from the frame header, 0 if absent */
+static UINT64 LZ4ContentSize(const UINT8 *in, UINTN size)
+{
+	if (!IsLZ4(in, size) || size < 15 || !(in[4] & LZ4_FLG_SIZE))
+		return 0;
+	return Get64(in + 6);
+}
+
+/* A run length: the 4-bit field, extended by bytes while they are 255 */
+static BOOLEAN LZ4Length(const UINT8 **ip, const UINT8 *end, UINTN *len)
+{
+	UINT8 b;
+
+	if (*len != 15)
+		return TRUE;
+	do {
+		if (*ip >= end)
+			return FALSE;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return TRUE;
+}
+
+/* One compressed block; 'out' is where it starts, everything before it
+   (down to 'base') may be referenced by matches */
+static BOOLEAN LZ4Block(const UINT8 *ip, const UINT8 *end, UINT8 *base,
+						UINT8 **pout, UINT8 *out_end)
+{
+	UINT8 *op = *pout;
+
+	for (;;)
+	{
+		UINT8 token;
+		UINTN len, offset;
+		const UINT8 *match;
+
+		if (ip >= end)
+			return FALSE;
+		token = *ip++;
+
+		// Literals, 8 bytes at a time when both sides have room
+		len = token >> 4;
+		if (!LZ4Length(&ip, end, &len) || len > (UINTN)(end - ip) ||
+				len > (UINTN)(out_end - op))
+			return FALSE;
+		if (len + 8 <= (UINTN)(end - ip) && len + 8 <= (UINTN)(out_end - op))
+		{
+			UINT8 *lit_end = op + len;
+			do {
+				__builtin_memcpy(op, ip, 8);
+				op += 8;
+				ip += 8;
+			} while (op < lit_end);
+			ip -= op - lit_end;
+			op = lit_end;
+		}
+		else
+		{
+			while (len--)
+				*op++ = *ip++;
+		}
+
+		// The last sequence of a block has no match
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return FALSE;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		len = token & 15;
+		if (!LZ4Length(&ip, end, &len))
+			return FALSE;
+		len += LZ4_MIN_MATCH;
+		if (offset == 0 || offset > (UINTN)(op - base) || len > (UINTN)(out_end - op))
+			return FALSE;
+		match = op - offset;
+
+		// Non-overlapping copies go 8 bytes at a time as well
+		if (offset >= 8 && len + 8 <= (UINTN)(out_end - op))
+		{
+			UINT8 *match_end = op + len;
+			do {
+				__builtin_memcpy(op, match, 8);
+				op += 8;
+				match += 8;
+			} while (op < match_end);
+			op = match_end;
+		}
+		else
+		{
+			while (len--)
+				*op++ = *match++;
+		}
+	}
+	*pout = op;
+	return TRUE;
+}
+
+/* Decompresses a whole frame into 'out', which holds exactly 'out_size' */
+static EFI_STATUS LZ4Decompress(const UINT8 *in, UINTN size, UINT8 *out, UINTN out_size)
+{
+	const UINT8 *end = in + size;
+	UINT8 *op = out, *out_end = out + out_size;
+	UINT8 flg;
+
+	if (!IsLZ4(in, size))
+		return EFI_LOAD_ERROR;
+	flg = in[4];
+	if ((flg & LZ4_FLG_VERSION) != 0x40)
+		return EFI_UNSUPPORTED;
+	in += 7 + ((flg & LZ4_FLG_SIZE) ? 8 : 0) + ((flg & LZ4_FLG_DICT_ID) ? 4 : 0);
+
+	for (;;)
+	{
+		UINT32 block;
+
+		if (end - in < 4)
+			return EFI_LOAD_ERROR;
+		block = Get32(in);
+		in += 4;
+		if (block == 0)		// EndMark
+			break;
+		if ((block & ~LZ4_UNCOMPRESSED) > (UINTN)(end - in))
+			return EFI_LOAD_ERROR;
+
+		if (block & LZ4_UNCOMPRESSED)
+		{
+			block &= ~LZ4_UNCOMPRESSED;
+			if (block > (UINTN)(out_end - op))
+				return EFI_LOAD_ERROR;
+			BootServices->CopyMem(op, (VOID *)in, block);
+			op += block;
+		}
+		else if (!LZ4Block(in, in + block, out, &op, out_end))
+		{
+			return EFI_LOAD_ERROR;
+		}
+		in += block + ((flg & LZ4_FLG_BLOCK_CSUM) ? 4 : 0);
+	}
+	return op == out_end ? EFI_SUCCESS : EFI_LOAD_ERROR;
+}
+
+/* Replaces an LZ4-compressed file buffer by its contents */
+static EFI_STATUS ExpandFile(FILE_READ *fr, EFI_MEMORY_TYPE type)
+{
+	UINT64 raw_size = LZ4ContentSize(fr->buffer, fr->size);
+	EFI_STATUS efi_status;
+	UINT8 *raw;
+
+	if (!IsLZ4(fr->buffer, fr->size))
+		return EFI_SUCCESS;
+	if (raw_size == 0)
+	{
+		LoadError(L"Compressed image without a content size!\r\n");
+		return EFI_LOAD_ERROR;
+	}
+	raw = AllocatePages(EFI_SIZE_TO_PAGES(raw_size), type);
+	if (!raw)
+	{
+		LoadError(L"Cannot allocate memory for the file.\r\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	efi_status = LZ4Decompress(fr->buffer, fr->size, raw, raw_size);
+	if (EFI_ERROR(efi_status))
+	{
+		LoadError(L"Corrupt compressed image!\r\n");
+		BootServices->FreePages((EFI_PHYSICAL_ADDRESS)raw, EFI_SIZE_TO_PAGES(raw_size));
+		return efi_status;
+	}
+	BootServices->FreePages((EFI_PHYSICAL_ADDRESS)fr->buffer, EFI_SIZE_TO_PAGES(fr->size));
+	fr->buffer = raw;
+	fr->size = raw_size;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Load the kernel's PT_LOAD segments from its ELF image, zero the part of
+ * each segment not backed by the file (BSS) and apply its RELATIVE
+ * relocations. A position-independent kernel (ET_DYN) goes anywhere and is
+ * relocated, an ET_EXEC kernel is placed at its link addresses (memory is
+ * identity-mapped until the kernel installs its own page table).
+ * Returns the entry point or NULL.
+ */
+static VOID *LoadKernel(VOID *image, UINTN size)
+{
+	ELF64_EHDR *eh = image;
+	ELF64_PHDR *ph;
+	ELF64_DYN *dyn = NULL;
+	EFI_PHYSICAL_ADDRESS base;
+	UINT64 lo = ~0ULL, hi = 0, bias, rela = 0, relasz = 0, relaent = sizeof(ELF64_RELA);
+	UINTN i, pages;
+	EFI_STATUS efi_status;
+
+	if (size < sizeof(*eh) || eh->e_magic != ELF_MAGIC ||
+			eh->e_class != ELFCLASS64 || eh->e_data != ELFDATA2LSB ||
+			eh->e_machine != EM_X86_64 ||
+			(eh->e_type != ET_EXEC && eh->e_type != ET_DYN) ||
+			eh->e_phentsize != sizeof(ELF64_PHDR) ||
+			eh->e_phoff + eh->e_phnum * sizeof(ELF64_PHDR) > size)
+	{
+		LoadError(L"The kernel is not an x86-64 ELF image!\r\n");
+		return NULL;
+	}
+	ph = (ELF64_PHDR *)((UINT8 *)image + eh->e_phoff);
+
+	// The span of all loadable segments
+	for (i = 0; i < eh->e_phnum; i++)
+	{
+		if (ph[i].p_type != PT_LOAD)
+			continue;
+		if (ph[i].p_offset + ph[i].p_filesz > size || ph[i].p_filesz > ph[i].p_memsz)
+		{
+			LoadError(L"Bad kernel segment!\r\n");
+			return NULL;
+		}
+		if (ph[i].p_vaddr < lo)
+			lo = ph[i].p_vaddr;
+		if (ph[i].p_vaddr + ph[i].p_memsz > hi)
+			hi = ph[i].p_vaddr + ph[i].p_memsz;
+	}
+	if (hi <= lo)
+	{
+		LoadError(L"The kernel has nothing to load!\r\n");
+		return NULL;
+	}
+	lo &= ~(UINT64)(EFI_PAGE_SIZE - 1);
+	pages = EFI_SIZE_TO_PAGES(hi - lo);
+
+	if (eh->e_type == ET_EXEC)
+	{
+		base = lo;
+		efi_status = BootServices->AllocatePages(AllocateAddress, EfiLoaderCode, pages, &base);
 	}
 	else
 	{
-		*size = file_info->FileSize;
+		efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiLoaderCode, pages, &base);
+	}
+	if (EFI_ERROR(efi_status))
+	{
+		LoadError(L"Cannot allocate memory for the kernel!\r\n");
+		return NULL;
 	}
-	FreePool(file_info);
+	bias = base - lo;
+
+	// Copy the file-backed part of each segment, zero the rest (BSS)
+	for (i = 0; i < eh->e_phnum; i++)
+	{
+		UINT8 *dst = (UINT8 *)(ph[i].p_vaddr + bias);
 
-	//Now that we have the actual file size, convert it to pages and allocate a buffer using AllocatePages()
-	UINTN pages = EFI_SIZE_TO_PAGES(*size);
-	buffer = AllocatePages(pages, EfiLoaderCode);
+		if (ph[i].p_type == PT_DYNAMIC)
+			dyn = (ELF64_DYN *)(ph[i].p_vaddr + bias);
+		if (ph[i].p_type != PT_LOAD)
+			continue;
+		BootServices->CopyMem(dst, (UINT8 *)image + ph[i].p_offset, ph[i].p_filesz);
+		BootServices->SetMem(dst + ph[i].p_filesz, ph[i].p_memsz - ph[i].p_filesz, 0);
+	}
 
-	//Read the file
-	efi_status = fh->Read(fh, size, buffer);
-	if(EFI_ERROR(efi_status))
+	// Apply relocations; a PIE kernel only has RELATIVE ones
+	for (; dyn && dyn->d_tag != DT_NULL; dyn++)
 	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Error while reading file.\r\n");
-		BootServices->Stall(5 * 1000000); // 5 seconds
-		
+		if (dyn->d_tag == DT_RELA)
+			rela = dyn->d_val;
+		else if (dyn->d_tag == DT_RELASZ)
+			relasz = dyn->d_val;
+		else if (dyn->d_tag == DT_RELAENT)
+			relaent = dyn->d_val;
+	}
+	for (i = 0; rela && i + relaent <= relasz; i += relaent)
+	{
+		ELF64_RELA *r = (ELF64_RELA *)(rela + bias + i);
+
+		switch (r->r_info & 0xFFFFFFFF)
+		{
+			case R_X86_64_NONE:
+				break;
+			case R_X86_64_RELATIVE:
+				*(UINT64 *)(r->r_offset + bias) = bias + r->r_addend;
+				break;
+			default:
+				LoadError(L"Unsupported kernel relocation!\r\n");
+				BootServices->FreePages(base, pages);
+				return NULL;
+		}
 	}
-	return buffer;
+
+	return (VOID *)(eh->e_entry + bias);
 }
 
 static VOID setExitBootServices()
@@ -233,22 +804,32 @@ static VOID setExitBootServices()
     EFI_MEMORY_DESCRIPTOR *memoryMap = NULL;
     UINT32 descriptorVersion;
 
-	//Memory map
+	UINTN bufferSize = 0;
+
+	while(1){
+
+		//Memory map
 
-	do{
-		efi_status = BootServices->GetMemoryMap(&mapSize, memoryMap, &mapKey, &descriptorSize, &descriptorVersion);
-		if(efi_status==EFI_BUFFER_TOO_SMALL){
-			UINTN pages = EFI_SIZE_TO_PAGES(mapSize+1);
-			memoryMap = AllocatePages(pages, EfiLoaderData);
+		do{
+			mapSize = bufferSize;
 			efi_status = BootServices->GetMemoryMap(&mapSize, memoryMap, &mapKey, &descriptorSize, &descriptorVersion);
-		
-		}
-		
-	} while(efi_status!=EFI_SUCCESS);
+			if(efi_status==EFI_BUFFER_TOO_SMALL){
+				//leave room for the descriptors added by this allocation
+				UINTN pages = EFI_SIZE_TO_PAGES(mapSize + 4 * descriptorSize);
+				memoryMap = AllocatePages(pages, EfiLoaderData);
+				bufferSize = pages * EFI_PAGE_SIZE;
+			}
 
-	//Exit boot services
+		} while(efi_status!=EFI_SUCCESS);
+
+		//The kernel builds its page allocator from the final memory map
+		BootInfo.mmap = (UINT64)memoryMap;
+		BootInfo.mmap_size = mapSize;
+		BootInfo.mmap_desc_size = descriptorSize;
+		BootInfo.mmap_desc_version = descriptorVersion;
+
+		//Exit boot services
 
-	while(1){
 		efi_status = BootServices->ExitBootServices(ImageHandle, mapKey);
 		if (efi_status == EFI_SUCCESS) {
 			break; 
@@ -260,94 +841,94 @@ static VOID setExitBootServices()
 			break;
 		}
 
+		//The memory map has changed, fetch it again
+
 	}
 	
 }
 
 
 /* Use System V ABI rather than EFI/Microsoft ABI. */
-typedef void (*kernel_entry_t)(void *, unsigned int *, int, void *, void *, int) __attribute__((sysv_abi));
+typedef void (*kernel_entry_t)(struct boot_info *) __attribute__((sysv_abi));
 
 
 EFI_STATUS EFIAPI
 efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
 {
 	
-	EFI_FILE_PROTOCOL *vh, *fh, *vh2, *fh2;
+	EFI_FILE_PROTOCOL *vh;
+	FILE_READ kernel_read, user_read;
 	EFI_STATUS efi_status;
-	UINT32 *fb;
 
 	ImageHandle = imageHandle;
 	SystemTable = systemTable;
 	BootServices = systemTable->BootServices;
+	Checkpoint(BOOT_EFI_ENTRY);
+	BootInfo.magic = BOOT_INFO_MAGIC;
+	BootInfo.version = BOOT_INFO_VERSION;
+	BootInfo.size = sizeof(BootInfo);
+	BootInfo.rsdp = FindRsdp();
 
 
 /*
 
-Read Kernel File
+Read Kernel and User Files
 
 */
 
-	// Get the volume handle and file handle of the kernel file
-	efi_status = OpenFile(&vh, &fh,0);
+	// One volume handle serves both files
+	efi_status = OpenVolume(&vh);
 	if (EFI_ERROR(efi_status))
-	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Error getting file and volume handles of kernel file!\r\n");
-		BootServices->Stall(5 * 1000000); // 5 seconds
 		return efi_status;
-	}
-
-	
-	// Load the kernel using the file handle
-	UINTN kernel_size=0;
-	VOID *kernel_buffer  = LoadFile(fh, &kernel_size);
-	 
-	//Close the volume and file handles
-	CloseFile(vh, fh);
-
-
-/*
-
-Read User File
 
-*/
+	efi_status = OpenRead(vh, L"\\EFI\\BOOT\\KERNEL", EfiBootServicesData, &kernel_read);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	efi_status = OpenRead(vh, L"\\EFI\\BOOT\\USER", EfiLoaderCode, &user_read);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	Checkpoint(BOOT_FILES_OPENED);
 
+	// The kernel is needed right away, USER streams in behind it
+	BootInfo.tsc_khz = TscKhz();
+	UINT64 kernel_start = ReadTsc();
+	efi_status = FinishRead(&kernel_read);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	UINT64 kernel_done = ReadTsc();
+	StartRead(&user_read);
 
-	//Allocate pages 2054 + 1 page (for kernel stack)
-	VOID *kernel_addr = AllocatePages(2055, EfiLoaderData);
-	kernel_addr += 0x1000;
-	
-	
-	// Get the volume handle and file handle of the user app
-	efi_status = OpenFile(&vh2, &fh2, 1);
+	// Images may be LZ4-compressed (see make.sh)
+	UINTN kernel_packed = kernel_read.size;
+	efi_status = ExpandFile(&kernel_read, EfiBootServicesData);
 	if (EFI_ERROR(efi_status))
-	{
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-										  L"Error getting file and volume handles of user app!\r\n");
-		BootServices->Stall(5 * 1000000); // 5 seconds
 		return efi_status;
+	UINT64 kernel_expanded = ReadTsc();
+	BootInfo.boot_tsc[BOOT_KERNEL_READ] = kernel_expanded;
+	PollRead(&user_read);
+
+	// Place the kernel's segments, the file itself is no longer needed
+	VOID *kernel_entry = LoadKernel(kernel_read.buffer, kernel_read.size);
+	BootServices->FreePages((EFI_PHYSICAL_ADDRESS)kernel_read.buffer, EFI_SIZE_TO_PAGES(kernel_read.size));
+	if (!kernel_entry)
+		return EFI_LOAD_ERROR;
+	Checkpoint(BOOT_KERNEL_LOADED);
+	PollRead(&user_read);
+
+	//Allocate pages for the kernel page table + 1 page (for kernel stack)
+	VOID *kernel_addr = AllocatePages(KERNEL_PT_PAGES + 1, EfiLoaderData);
+	if (!kernel_addr)
+	{
+		LoadError(L"Cannot allocate the kernel page table!\r\n");
+		return EFI_OUT_OF_RESOURCES;
 	}
+	BootInfo.kernel_stack = (UINT64)kernel_addr + 0x1000;
+	PollRead(&user_read);
 
-
-	// Load the user app using the file handle
-	UINTN user_size=0;
- 	VOID *user_buffer = LoadFile(fh2,&user_size);
-	UINTN user_pages = EFI_SIZE_TO_PAGES(user_size);
-
-	//Close the volume and file handles
-		CloseFile(vh2, fh2);
 /*
-	Allocate pages 4 (for new user page table) + 1 page (for USER stack)
-	+ 1 page (for tss rsp[0]) + 1 page (for lazy load)
-	+ 1 page (for tss)
-	+ 1 page (for TLS)
-	+ 1 page (for gnttab_table)
-	+ 1 page (for null terminated msg)
-	+ 1 page (page for the other side)
+	All other memory (user page table and stack, TSS, TLS, grant table, ...)
+	is allocated by the kernel from the memory map
 */
-	VOID *user_addr = AllocatePages(12, EfiLoaderData);
-	user_addr += 0x1000;
 
 /*
 
@@ -356,7 +937,28 @@ Frame Buffer
 */
 
 	//Get the frame buffer base address
-	fb = SetGraphicsMode(800, 600);
+	if (!SetGraphicsMode(800, 600))
+		return EFI_UNSUPPORTED;
+	Checkpoint(BOOT_GRAPHICS);
+
+	// Wait for the rest of USER
+	efi_status = FinishRead(&user_read);
+	vh->Close(vh);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	UINT64 user_done = ReadTsc();
+	UINTN user_packed = user_read.size;
+	efi_status = ExpandFile(&user_read, EfiLoaderCode);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	UINT64 user_expanded = ReadTsc();
+	BootInfo.boot_tsc[BOOT_USER_READ] = user_expanded;
+
+	PrintLoadTimes(L"KERNEL", kernel_packed, kernel_read.size,
+				   kernel_done - kernel_start, kernel_expanded - kernel_done, BootInfo.tsc_khz);
+	PrintLoadTimes(L"USER", user_packed, user_read.size,
+				   user_done - kernel_done, user_expanded - user_done, BootInfo.tsc_khz);
+	AddModule("USER", user_read.buffer, user_read.size);
 
 /*
 
@@ -366,12 +968,13 @@ Exit Boot Services
 
 	//Memory Map and ExitBootServices()
 	setExitBootServices();
+	Checkpoint(BOOT_EXIT_BOOT_SERVICES);
 	
 
-	// kernel's _start() is at base #0 (pure binary format)
+	// kernel's _start() is the ELF entry point
 	// cast the function pointer appropriately and call the function
-	kernel_entry_t func = (kernel_entry_t)kernel_buffer;
-	func(  kernel_addr, fb, 800, user_addr, user_buffer, user_pages );
+	kernel_entry_t func = (kernel_entry_t)kernel_entry;
+	func(&BootInfo);
 
 	return EFI_SUCCESS;
 }
@@ -0,0 +1,191 @@
+/*
+ * evtchn.c - event channel upcalls
+ *
+ * Xen delivers all event channel notifications of vCPU 0 through a single
+ * IDT vector (HVM_PARAM_CALLBACK_IRQ, vector type). The upcall walks the
+ * two-level pending bitmap in shared_info: evtchn_pending_sel has a bit
+ * per word of evtchn_pending that may have pending ports, and each port
+ * is dispatched to the handler bound to it.
+ */
+
+#include <evtchn.h>
+#include <hypercall.h>
+#include <hvm/hvm_op.h>
+#include <hvm/params.h>
+#include <os.h>
+#include <pmm.h>
+#include <printf.h>
+
+#define BITS_PER_WORD	(sizeof(xen_ulong_t) * 8)
+
+/* Callback via an IDT vector (no LAPIC EOI needed) */
+#define HVM_CALLBACK_VECTOR(v)	((2ULL << 56) | (v))
+
+extern shared_info_t *HYPERVISOR_shared_info;
+
+struct evtchn_slot {
+	evtchn_handler_t handler;
+	void *data;
+};
+
+/* Indexed by port, allocated at run time to keep the kernel image small */
+static struct evtchn_slot *evtchn_slots;
+
+void *evtchn_trap_ptr;
+
+static inline unsigned long
+bsf(unsigned long word)
+{
+	__asm__("bsf %1, %0" : "=r" (word) : "rm" (word));
+	return word;
+}
+
+static inline unsigned long
+xchg_word(volatile xen_ulong_t *ptr, unsigned long val)
+{
+	__asm__ __volatile__("xchgq %0, %1" : "+r" (val), "+m" (*ptr) : : "memory");
+	return val;
+}
+
+static inline void
+sync_set_bit(unsigned long nr, volatile xen_ulong_t *addr)
+{
+	__asm__ __volatile__("lock; btsq %1, %0" : "+m" (*addr) : "r" (nr) : "memory");
+}
+
+static inline void
+sync_clear_bit(unsigned long nr, volatile xen_ulong_t *addr)
+{
+	__asm__ __volatile__("lock; btrq %1, %0" : "+m" (*addr) : "r" (nr) : "memory");
+}
+
+void
+evtchn_mask(evtchn_port_t port)
+{
+	sync_set_bit(port % BITS_PER_WORD,
+		&HYPERVISOR_shared_info->evtchn_mask[port / BITS_PER_WORD]);
+}
+
+/* Xen re-raises the upcall if the port became pending while masked */
+void
+evtchn_unmask(evtchn_port_t port)
+{
+	struct evtchn_unmask op;
+
+	op.port = port;
+	HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op);
+}
+
+int
+evtchn_bind(evtchn_port_t port, evtchn_handler_t handler, void *data)
+{
+	if (!evtchn_slots || port >= EVTCHN_NR_PORTS)
+		return -1;
+
+	evtchn_mask(port);
+	evtchn_slots[port].data = data;
+	wmb();
+	evtchn_slots[port].handler = handler;
+	evtchn_unmask(port);
+	return 0;
+}
+
+void
+evtchn_unbind(evtchn_port_t port)
+{
+	struct evtchn_close op;
+
+	if (!evtchn_slots || port >= EVTCHN_NR_PORTS)
+		return;
+
+	evtchn_mask(port);
+	evtchn_slots[port].handler = NULL;
+	op.port = port;
+	HYPERVISOR_event_channel_op(EVTCHNOP_close, &op);
+}
+
+/* Called from evtchn_trap with interrupts disabled */
+void
+evtchn_do_upcall(void)
+{
+	shared_info_t *s = HYPERVISOR_shared_info;
+	struct vcpu_info *vcpu = &s->vcpu_info[0];
+	unsigned long l1, l2, l1i, l2i;
+	evtchn_port_t port;
+
+	trace(TRACE_IRQ, EVTCHN_VECTOR, 0);
+	do {
+		vcpu->evtchn_upcall_pending = 0;
+		wmb();
+		l1 = xchg_word(&vcpu->evtchn_pending_sel, 0);
+
+		while (l1 != 0) {
+			l1i = bsf(l1);
+			l1 &= ~(1UL << l1i);
+
+			while ((l2 = s->evtchn_pending[l1i] & ~s->evtchn_mask[l1i]) != 0) {
+				l2i = bsf(l2);
+				port = l1i * BITS_PER_WORD + l2i;
+				sync_clear_bit(l2i, &s->evtchn_pending[l1i]);
+
+				if (evtchn_slots[port].handler) {
+					evtchn_slots[port].handler(port, evtchn_slots[port].data);
+				} else {
+					/* Nobody listens, keep it quiet */
+					evtchn_mask(port);
+				}
+			}
+		}
+	} while (vcpu->evtchn_upcall_pending);
+}
+
+/*
+ * Sleep until a handler (or a timer) sets *done. Interrupts are only
+ * enabled together with hlt (sti takes effect after the next instruction),
+ * so an upcall cannot slip in between the check and the halt.
+ */
+void
+evtchn_wait(volatile int *done)
+{
+	unsigned long flags;
+
+	__asm__ __volatile__("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	while (!*done) {
+		__asm__ __volatile__("sti; hlt; cli" ::: "memory");
+	}
+	__asm__ __volatile__("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
+}
+
+/* Returns 0, or -1 if upcalls are unavailable (evtchn_bind() then fails) */
+int
+evtchn_init(void)
+{
+	struct xen_hvm_param param;
+	unsigned int i, pages;
+
+	pages = (EVTCHN_NR_PORTS * sizeof(struct evtchn_slot) + PAGE_SIZE - 1) / PAGE_SIZE;
+	evtchn_slots = pmm_alloc_pages(pmm_order(pages));
+	if (!evtchn_slots) {
+		printf("cannot allocate event channel slots!\n");
+		return -1;
+	}
+	for (i = 0; i < EVTCHN_NR_PORTS; i++)
+		evtchn_slots[i].handler = NULL;
+
+	/* Everything stays masked until bound */
+	for (i = 0; i < EVTCHN_NR_PORTS / BITS_PER_WORD; i++)
+		HYPERVISOR_shared_info->evtchn_mask[i] = ~0UL;
+	HYPERVISOR_shared_info->vcpu_info[0].evtchn_upcall_mask = 0;
+
+	param.domid = DOMID_SELF;
+	param.index = HVM_PARAM_CALLBACK_IRQ;
+	param.value = HVM_CALLBACK_VECTOR(EVTCHN_VECTOR);
+	if (HYPERVISOR_hvm_op(HVMOP_set_param, &param)) {
+		printf("cannot set the event channel callback!\n");
+		pmm_free_pages(evtchn_slots, pmm_order(pages));
+		evtchn_slots = NULL;
+		return -1;
+	}
+	printf("event channel upcalls on vector %d\n", EVTCHN_VECTOR);
+	return 0;
+}
@@ -1,25 +1,154 @@
 /*
  * fb.c - a framebuffer console driver (Assignment 2, ECE 6504)
  * Copyright 2021 Ruslan Nikolaev <rnikola@vt.edu>
+ *
+ * Once fb_init_shadow() has run, text is rendered into a shadow copy of the
+ * screen in RAM, organized as a ring of text rows: scrolling only advances
+ * the ring's top row. fb_flush() then copies the dirty part of each text
+ * row to the (write-combining) framebuffer with non-temporal stores, so
+ * the framebuffer is never read back.
+ *
+ * Glyphs are expanded to foreground/background pixels by a blitter picked
+ * at boot: AVX2 (a row per instruction sequence) or SSE2 when the CPU has
+ * them, scalar otherwise. The kernel is built with -mgeneral-regs-only and
+ * only the blitters and fb_stream_sse2() are compiled for SIMD; as the
+ * kernel does not own those registers, their callers bracket them with
+ * fb_fpu_save()/fb_fpu_restore() under the console lock.
  */
 
 #include <fb.h>
 #include <types.h>
+#include <pmm.h>
+#include <string.h>
+#include <cpuid.h>
+#include <rdtsc.h>
+#include <timer.h>
+#include <printf.h>
 
 extern unsigned char __ascii_font[2048]; /* ascii_font.c */
 
 #define FONT_WIDTH 8
 #define FONT_HEIGHT 16
 
+#define FB_MAX_ROWS 128
+
 static unsigned int *Fb;
-static unsigned int Width, PosX, PosY, MaxX, MaxY;
+static unsigned int Pitch, PosX, PosY, MaxX, MaxY;	/* Pitch: pixels per scanline */
+
+/* The shadow ring, NULL while drawing straight to the framebuffer */
+static unsigned int *Shadow;
+static unsigned int Top;	/* the ring row shown on screen row 0 */
+static int StreamSSE;	/* Fb and Pitch keep every row 16-byte aligned */
+static size_t RowPixels;	/* pixels in a text row */
+
+/* Dirty columns [DirtyLo, DirtyHi) of each screen row */
+static uint16_t DirtyLo[FB_MAX_ROWS], DirtyHi[FB_MAX_ROWS];
+
+static uint32_t Fg = 0xFFFFFFFFU, Bg = 0x00000000U;
+
+/* Draws one glyph at dst, 'stride' pixels per scanline */
+typedef void (*fb_blit_t)(unsigned int *dst, size_t stride,
+	const unsigned char *glyph, uint32_t fg, uint32_t bg);
+
+static fb_blit_t Blit;
+static int BlitAVX;
+
+/* The interrupted SIMD state, only used under the console lock */
+static uint8_t FpuSave[512] __attribute__((aligned(16)));
+
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v4u_u __attribute__((vector_size(16), aligned(4)));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef uint32_t v8u_u __attribute__((vector_size(32), aligned(4)));
+
+static void fb_blit_scalar(unsigned int *dst, size_t stride,
+	const unsigned char *glyph, uint32_t fg, uint32_t bg)
+{
+	for (size_t j = 0; j < FONT_HEIGHT; j++) {
+		/* for simplicity, assume that FONT_WIDTH=8, i.e., fits in one byte */
+		signed char bitmap = glyph[j];
+		for (size_t i = 0; i < FONT_WIDTH; i++) {
+			uint32_t mask = (signed int) (signed char) (bitmap >> 7); /* propagate the sign bit */
+			dst[i] = (fg & mask) | (bg & ~mask);
+			bitmap <<= 1;
+		}
+		dst += stride;
+	}
+}
+
+/* Each pixel tests its bit of the broadcast row: 4 pixels per vector */
+__attribute__((target("sse2")))
+static void fb_blit_sse2(unsigned int *dst, size_t stride,
+	const unsigned char *glyph, uint32_t fg, uint32_t bg)
+{
+	const v4u hi = { 0x80, 0x40, 0x20, 0x10 }, lo = { 0x08, 0x04, 0x02, 0x01 };
+	const v4u vfg = { fg, fg, fg, fg }, vbg = { bg, bg, bg, bg };
+
+	for (size_t j = 0; j < FONT_HEIGHT; j++) {
+		v4u row = (v4u) { 0, 0, 0, 0 } + glyph[j];
+		v4u m0 = (v4u) ((row & hi) == hi), m1 = (v4u) ((row & lo) == lo);
+		*(v4u_u *) dst = (vfg & m0) | (vbg & ~m0);
+		*(v4u_u *) (dst + 4) = (vfg & m1) | (vbg & ~m1);
+		dst += stride;
+	}
+}
+
+/* The same with 8 pixels, i.e., a whole glyph row, per vector */
+__attribute__((target("avx2")))
+static void fb_blit_avx2(unsigned int *dst, size_t stride,
+	const unsigned char *glyph, uint32_t fg, uint32_t bg)
+{
+	const v8u bits = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+	const v8u vfg = { fg, fg, fg, fg, fg, fg, fg, fg };
+	const v8u vbg = { bg, bg, bg, bg, bg, bg, bg, bg };
+
+	for (size_t j = 0; j < FONT_HEIGHT; j++) {
+		v8u row = (v8u) { 0, 0, 0, 0, 0, 0, 0, 0 } + glyph[j];
+		v8u m = (v8u) ((row & bits) == bits);
+		*(v8u_u *) dst = (vfg & m) | (vbg & ~m);
+		dst += stride;
+	}
+}
+
+/* AVX2 also needs the OS (xsave_init()) to have enabled the YMM state */
+static int fb_has_avx2(void)
+{
+	uint32_t eax, ebx, ecx, edx, max;
+
+	x86_cpuid(0, &max, &ebx, &ecx, &edx);
+	x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (max < 7 || !(ecx & (1U << 27)) || (xgetbv(0) & 0x6) != 0x6)
+		return 0;
+	x86_cpuid(7, &eax, &ebx, &ecx, &edx);
+	return (ebx & (1U << 5)) != 0;
+}
+
+void fb_set_color(uint32_t fg, uint32_t bg)
+{
+	Fg = fg;
+	Bg = bg;
+}
+
+void fb_fpu_save(void)
+{
+	__asm__ __volatile__ ("fxsave64 %0" : "=m" (FpuSave));
+}
+
+void fb_fpu_restore(void)
+{
+	/* Leave no dirty upper YMM halves behind for the SSE code of the user */
+	if (BlitAVX)
+		__asm__ __volatile__ ("vzeroupper" ::: "memory");
+	__asm__ __volatile__ ("fxrstor64 %0" : : "m" (FpuSave));
+}
 
 #define HELLO_STATEMENT \
 	"Framebuffer Console (ECE 6504)\nCopyright (C) 2021 Ruslan Nikolaev\n\n"
 
-void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
+void fb_init(unsigned int *fb, unsigned int width, unsigned int height,
+	unsigned int pitch)
 {
-	size_t i, num = (size_t) width * height;
+	size_t i, num = (size_t) pitch * height;
 	const char *__hello_statement = HELLO_STATEMENT;
 
 	/* Clean up the screen */
@@ -28,11 +157,15 @@ void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
 	}
 
 	Fb = fb;
-	Width = width;
+	Pitch = pitch;
 	PosX = 0;
 	PosY = 0;
 	MaxX = width / FONT_WIDTH;
 	MaxY = height / FONT_HEIGHT;
+	if (MaxY > FB_MAX_ROWS)
+		MaxY = FB_MAX_ROWS;
+	RowPixels = (size_t) Pitch * FONT_HEIGHT;
+	Blit = fb_blit_scalar; /* no CPUID checks yet */
 
 	/* Print a hello statement */
 	for (i = 0; i < sizeof(HELLO_STATEMENT)-1; i++) {
@@ -40,13 +173,143 @@ void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
 	}
 }
 
+void fb_init_shadow(void)
+{
+	size_t size = RowPixels * MaxY * sizeof(unsigned int);
+	unsigned int *shadow = pmm_alloc_pages(pmm_order((size + PAGE_SIZE - 1) / PAGE_SIZE));
+
+	if (fb_has_avx2()) {
+		Blit = fb_blit_avx2;
+		BlitAVX = 1;
+	} else {
+		Blit = fb_blit_sse2;
+	}
+
+	if (!shadow)
+		return;
+
+	/* Read the screen back one last time */
+	memcpy(shadow, Fb, size);
+	StreamSSE = (((uintptr_t) Fb | Pitch * sizeof(unsigned int)) & 15) == 0;
+	Top = 0;
+	Shadow = shadow;
+}
+
+static inline void fb_mark(unsigned int row, unsigned int lo, unsigned int hi)
+{
+	if (DirtyLo[row] >= DirtyHi[row]) {
+		DirtyLo[row] = lo;
+		DirtyHi[row] = hi;
+		return;
+	}
+	if (lo < DirtyLo[row])
+		DirtyLo[row] = lo;
+	if (hi > DirtyHi[row])
+		DirtyHi[row] = hi;
+}
+
+/*
+ * Stream 'bytes' (a multiple of 32) from 'src' to 'dst', both 16-byte
+ * aligned, bypassing the caches
+ */
+__attribute__((target("sse2")))
+static void fb_stream_sse2(void *dst, const void *src, size_t bytes)
+{
+	__asm__ __volatile__ (
+		"1:\n\t"
+		"movdqa (%1), %%xmm0\n\t"
+		"movdqa 16(%1), %%xmm1\n\t"
+		"movntdq %%xmm0, (%0)\n\t"
+		"movntdq %%xmm1, 16(%0)\n\t"
+		"addq $32, %1\n\t"
+		"addq $32, %0\n\t"
+		"subq $32, %2\n\t"
+		"jnz 1b"
+		: "+r" (dst), "+r" (src), "+r" (bytes)
+		:
+		: "xmm0", "xmm1", "memory", "cc"
+	);
+}
+
+/* The same with 8-byte movnti stores, which need no alignment */
+static void fb_stream_movnti(void *dst, const void *src, size_t bytes)
+{
+	uint64_t tmp;
+
+	__asm__ __volatile__ (
+		"1:\n\t"
+		"movq (%2), %3\n\t"
+		"movnti %3, (%1)\n\t"
+		"addq $8, %2\n\t"
+		"addq $8, %1\n\t"
+		"subq $8, %0\n\t"
+		"jnz 1b"
+		: "+r" (bytes), "+r" (dst), "+r" (src), "=&r" (tmp)
+		:
+		: "memory", "cc"
+	);
+}
+
+static inline void fb_stream(void *dst, const void *src, size_t bytes)
+{
+	if (StreamSSE)
+		fb_stream_sse2(dst, src, bytes);
+	else
+		fb_stream_movnti(dst, src, bytes);
+}
+
+void fb_flush(void)
+{
+	unsigned int row, j, ring;
+	int flushed = 0;
+
+	if (!Shadow)
+		return;
+
+	for (row = 0; row < MaxY; row++) {
+		size_t lo = DirtyLo[row], hi = DirtyHi[row];
+		unsigned int *src, *dst;
+
+		if (lo >= hi)
+			continue;
+		ring = Top + row;
+		if (ring >= MaxY)
+			ring -= MaxY;
+		src = Shadow + ring * RowPixels + lo * FONT_WIDTH;
+		dst = Fb + row * RowPixels + lo * FONT_WIDTH;
+		for (j = 0; j < FONT_HEIGHT; j++) {
+			fb_stream(dst, src, (hi - lo) * FONT_WIDTH * sizeof(unsigned int));
+			src += Pitch;
+			dst += Pitch;
+		}
+		DirtyLo[row] = DirtyHi[row] = 0;
+		flushed = 1;
+	}
+
+	/* Non-temporal stores are weakly ordered */
+	if (flushed)
+		__asm__ __volatile__ ("sfence" ::: "memory");
+}
+
 static void fb_scrollup(void)
 {
+	unsigned int row;
+
+	if (Shadow) {
+		/* The old top row becomes the (clean) bottom row */
+		memset(Shadow + Top * RowPixels, 0, RowPixels * sizeof(unsigned int));
+		if (++Top == MaxY)
+			Top = 0;
+		for (row = 0; row < MaxY; row++)
+			fb_mark(row, 0, MaxX);
+		return;
+	}
+
 	/* Move the text up one row */
-	size_t cur = 0, count = Width * ((MaxY - 1) * FONT_HEIGHT);
-	size_t row = Width * FONT_HEIGHT;
+	size_t cur = 0, count = Pitch * ((MaxY - 1) * FONT_HEIGHT);
+	size_t rowsize = Pitch * FONT_HEIGHT;
 	do {
-		Fb[cur] = Fb[cur+row];
+		Fb[cur] = Fb[cur+rowsize];
 		cur++;
 	} while (--count != 0);
 
@@ -54,38 +317,106 @@ static void fb_scrollup(void)
 	do {
 		Fb[cur] = 0x00000000U;
 		cur++;
-	} while (--row != 0);
+	} while (--rowsize != 0);
 }
 
-void fb_output(char ch)
+static inline unsigned int *fb_row_base(unsigned int row)
 {
-	size_t cur;
-	unsigned char *ptr;
-	if ((signed char) ch <= 0) { /* not in the ASCII subset */
-		if (ch == 0) return;
-		ch = '?'; /* an unknown character */
+	if (Shadow) {
+		row += Top;
+		if (row >= MaxY)
+			row -= MaxY;
+		return Shadow + row * RowPixels;
 	}
-	if (ch == '\n' || PosX == MaxX) {
-		PosX = 0;
-		PosY++;
+	return Fb + row * RowPixels;
+}
+
+/* Cursor bookkeeping is done once per run of glyphs on the same row */
+void fb_write(const char *str, size_t len)
+{
+	const char *end = str + len;
+
+	while (str != end) {
+		unsigned int *base, start;
+
+		if (*str == '\n' || PosX == MaxX) {
+			PosX = 0;
+			PosY++;
+		}
+		if (PosY == MaxY) {
+			PosY--;
+			fb_scrollup();
+		}
+		if (*str == '\n') {
+			str++;
+			continue;
+		}
+
+		base = fb_row_base(PosY);
+		start = PosX;
+		while (str != end && *str != '\n' && PosX != MaxX) {
+			unsigned char ch = *str++;
+			if ((signed char) ch <= 0) { /* not in the ASCII subset */
+				if (ch == 0) continue;
+				ch = '?'; /* an unknown character */
+			}
+			Blit(base + (size_t) PosX * FONT_WIDTH, Pitch,
+				&__ascii_font[ch * (FONT_WIDTH * FONT_HEIGHT / 8)], Fg, Bg);
+			PosX++;
+		}
+		if (Shadow && PosX != start)
+			fb_mark(PosY, start, PosX);
 	}
-	if (PosY == MaxY) {
-		PosY--;
-		fb_scrollup();
+}
+
+void fb_output(char ch)
+{
+	fb_write(&ch, 1);
+}
+
+#ifdef FB_BENCHMARK
+#define FB_BENCH_GLYPHS 100000
+
+static uint64_t fb_bench_one(fb_blit_t blit, unsigned int *row)
+{
+	uint64_t start = rdtsc();
+
+	for (unsigned int n = 0; n < FB_BENCH_GLYPHS; n++) {
+		unsigned char ch = ' ' + n % 95;
+		blit(row + (n % MaxX) * FONT_WIDTH, Pitch,
+			&__ascii_font[ch * (FONT_WIDTH * FONT_HEIGHT / 8)], Fg, Bg);
 	}
-	if (ch == '\n')
+	return timer_tsc_to_ns(rdtsc() - start);
+}
+
+/* Glyphs per second of each blitter, drawn into a scratch text row */
+void fb_benchmark(void)
+{
+	unsigned int order = pmm_order((RowPixels * sizeof(unsigned int) + PAGE_SIZE - 1) / PAGE_SIZE);
+	unsigned int *row = pmm_alloc_pages(order);
+	uint64_t ns[3] = { 0, 0, 0 };
+	unsigned long flags;
+
+	if (!row)
 		return;
-	ptr = &__ascii_font[(unsigned char) ch * (FONT_WIDTH * FONT_HEIGHT / 8)];
-	cur = (size_t) PosX * FONT_WIDTH + (PosY * FONT_HEIGHT) * Width;
-	for (size_t j = 0; j < FONT_HEIGHT; j++) {
-		/* for simplicity, assume that FONT_WIDTH=8, i.e., fits in one byte */
-		signed char bitmap = ptr[j];
-		for (size_t i = 0; i < FONT_WIDTH; i++) {
-			signed char color = (bitmap >> 7); /* propagate the sign bit */
-			Fb[cur + i] = (signed int) color; /* sign extend to 32 bits */
-			bitmap <<= 1;
-		}
-		cur += Width;
-	}
-	PosX++;
+	/* The save area is shared with printf() */
+	flags = console_lock_irqsave();
+	fb_fpu_save();
+	ns[0] = fb_bench_one(fb_blit_scalar, row);
+	ns[1] = fb_bench_one(fb_blit_sse2, row);
+	if (BlitAVX)
+		ns[2] = fb_bench_one(fb_blit_avx2, row);
+	fb_fpu_restore();
+	console_unlock_irqrestore(flags);
+	pmm_free_pages(row, order);
+
+	printf("fb: glyphs/s scalar %d, SSE2 %d, AVX2 %d\n",
+		(int) (ns[0] ? FB_BENCH_GLYPHS * 1000000000ULL / ns[0] : 0),
+		(int) (ns[1] ? FB_BENCH_GLYPHS * 1000000000ULL / ns[1] : 0),
+		(int) (ns[2] ? FB_BENCH_GLYPHS * 1000000000ULL / ns[2] : 0));
+}
+#else
+void fb_benchmark(void)
+{
 }
+#endif
@@ -20,34 +20,132 @@
 #include <memory.h>
 #include <printf.h>
 #include <os.h>
+#include <pmm.h>
 
 #define GNTTAB_PAGE_SIZE 4096U
 #define GNTTAB_PAGE_SHIFT 12U
 
 #define NR_RESERVED_ENTRIES 8
 
-/* NR_GRANT_FRAMES must be less than or equal to that configured in Xen */
-#define NR_GRANT_FRAMES 1
-#define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * GNTTAB_PAGE_SIZE / sizeof(grant_entry_v1_t))
+/*
+ * The table starts with one frame and grows on demand, one frame at a time,
+ * up to the limit configured in Xen (GNTTABOP_query_size), capped at
+ * GNTTAB_MAX_FRAMES. The whole range is reserved up front so that the
+ * table stays virtually contiguous.
+ */
+#define GNTTAB_MAX_FRAMES 64
+#define ENTRIES_PER_FRAME (GNTTAB_PAGE_SIZE / sizeof(grant_entry_v1_t))
+
+_Static_assert(GRANT_BOOTSTRAP_REF == ENTRIES_PER_FRAME - 1,
+        "the bootstrap ref must be the last one of frame 0");
 
 grant_entry_v1_t *gnttab_table;
 
-static grant_ref_t gnttab_list[NR_GRANT_ENTRIES];
+static unsigned int max_grant_frames;
+static volatile unsigned int nr_grant_frames;
+static volatile unsigned int gnttab_grow_lock;
+
+/*
+ * Free entries form a lock-free (Treiber) stack threaded through
+ * gnttab_list. The head holds the top ref in its low 32 bits and a
+ * counter in its high 32 bits, bumped on every update so that a stale
+ * compare-and-swap cannot succeed (ABA). GRANT_INVALID_REF (a reserved
+ * entry) terminates the list.
+ */
+static grant_ref_t *gnttab_list;
+static volatile uint64_t gnttab_free_head;
+
+#define HEAD_REF(h) ((grant_ref_t)(h))
+#define HEAD_NEXT(h, ref) (((((h) >> 32) + 1) << 32) | (ref))
+
+/* Push the chain from first to last (already linked through gnttab_list) */
+static void
+put_free_chain(grant_ref_t first, grant_ref_t last)
+{
+    uint64_t old;
+
+    do {
+        old = gnttab_free_head;
+        gnttab_list[last] = HEAD_REF(old);
+        wmb();
+    } while (__sync_val_compare_and_swap(&gnttab_free_head, old,
+                HEAD_NEXT(old, first)) != old);
+}
 
 static void
 put_free_entry(grant_ref_t ref)
 {
-    gnttab_list[ref] = gnttab_list[0];
-    gnttab_list[0]  = ref;
+    put_free_chain(ref, ref);
+}
+
+/* Map one more grant frame and free its entries; -1 if at the limit */
+static int
+gnttab_grow(void)
+{
+    struct xen_add_to_physmap xatp;
+    unsigned int frame, first, last, i;
+
+    if (__sync_val_compare_and_swap(&gnttab_grow_lock, 0, 1) != 0) {
+        /* Someone else is growing the table, let the caller retry */
+        while (gnttab_grow_lock)
+            __asm__ __volatile__("pause");
+        return 0;
+    }
+
+    frame = nr_grant_frames;
+    if (frame == max_grant_frames) {
+        gnttab_grow_lock = 0;
+        return -1;
+    }
+
+    xatp.domid = DOMID_SELF;
+    xatp.idx = frame;
+    xatp.space = XENMAPSPACE_grant_table;
+    xatp.gpfn = ((unsigned long) gnttab_table >> GNTTAB_PAGE_SHIFT) + frame;
+    if (HYPERVISOR_memory_op(XENMEM_add_to_physmap, &xatp)) {
+        printf("cannot map grant frame %d!\n", frame);
+        max_grant_frames = frame;
+        gnttab_grow_lock = 0;
+        return -1;
+    }
+
+    /* Lowest ref on top; GRANT_BOOTSTRAP_REF (end of frame 0) is set aside */
+    first = frame * ENTRIES_PER_FRAME;
+    if (first < NR_RESERVED_ENTRIES)
+        first = NR_RESERVED_ENTRIES;
+    last = (frame + 1) * ENTRIES_PER_FRAME - 1;
+    if (last == GRANT_BOOTSTRAP_REF)
+        last--;
+    for (i = first; i < last; i++)
+        gnttab_list[i] = i + 1;
+    put_free_chain(first, last);
+
+    nr_grant_frames = frame + 1;
+    wmb();
+    gnttab_grow_lock = 0;
+    return 0;
 }
 
+/* Returns GRANT_INVALID_REF once the table cannot grow any further */
 static grant_ref_t
 get_free_entry(void)
 {
-    unsigned int ref;
-    ref = gnttab_list[0];
-    gnttab_list[0] = gnttab_list[ref];
-    return ref;
+    uint64_t old;
+    grant_ref_t ref;
+
+    for (;;) {
+        old = gnttab_free_head;
+        ref = HEAD_REF(old);
+        if (ref == GRANT_INVALID_REF) {
+            if (gnttab_grow() < 0)
+                return GRANT_INVALID_REF;
+            continue;
+        }
+        rmb();
+        if (__sync_val_compare_and_swap(&gnttab_free_head, old,
+                    HEAD_NEXT(old, gnttab_list[ref])) == old)
+            return ref;
+    }
 }
 
 grant_ref_t
@@ -56,6 +154,24 @@ gnttab_grant_access(domid_t domid, unsigned long frame, int readonly)
     grant_ref_t ref;
 
     ref = get_free_entry();
+    if (ref == GRANT_INVALID_REF)
+        return ref;
+    gnttab_table[ref].frame = frame;
+    gnttab_table[ref].domid = domid;
+    wmb();
+    readonly *= GTF_readonly;
+    gnttab_table[ref].flags = GTF_permit_access | readonly;
+
+    return ref;
+}
+
+grant_ref_t
+gnttab_grant_bootstrap(domid_t domid, unsigned long frame, int readonly)
+{
+    grant_ref_t ref = GRANT_BOOTSTRAP_REF;
+
+    if (gnttab_table[ref].flags & GTF_permit_access)
+        return GRANT_INVALID_REF;
     gnttab_table[ref].frame = frame;
     gnttab_table[ref].domid = domid;
     wmb();
@@ -71,6 +187,8 @@ gnttab_grant_transfer(domid_t domid, unsigned long pfn)
     grant_ref_t ref;
 
     ref = get_free_entry();
+    if (ref == GRANT_INVALID_REF)
+        return ref;
     gnttab_table[ref].frame = pfn;
     gnttab_table[ref].domid = domid;
     wmb();
@@ -128,27 +246,97 @@ gnttab_end_transfer(grant_ref_t ref)
 void
 init_gnttab(void)
 {
-    struct xen_add_to_physmap xatp;
-    unsigned long page = (unsigned long) gnttab_table >> GNTTAB_PAGE_SHIFT;
-    int i;
+    struct gnttab_query_size query;
+    unsigned int list_pages;
 
-    for (i = NR_RESERVED_ENTRIES; i < NR_GRANT_ENTRIES; i++)
-        put_free_entry(i);
+    query.dom = DOMID_SELF;
+    if (HYPERVISOR_grant_table_op(GNTTABOP_query_size, &query, 1) ||
+            query.status != GNTST_okay || query.max_nr_frames == 0)
+        query.max_nr_frames = 1;
+    max_grant_frames = query.max_nr_frames;
+    if (max_grant_frames > GNTTAB_MAX_FRAMES)
+        max_grant_frames = GNTTAB_MAX_FRAMES;
 
-    i = NR_GRANT_FRAMES;
-    do {
-        i--;
-        xatp.domid = DOMID_SELF;
-        xatp.idx = i;
-        xatp.space = XENMAPSPACE_grant_table;
-        xatp.gpfn = page + i;
-        if (HYPERVISOR_memory_op(XENMEM_add_to_physmap, &xatp)) {
-            printf("cannot map gnttab_table!");
-			while (1) {} // halt the system
-		}
-    } while (i != 0);
-
-    printf("gnttab_table mapped at %p.\n", gnttab_table);
+    list_pages = (max_grant_frames * ENTRIES_PER_FRAME * sizeof(grant_ref_t) +
+            GNTTAB_PAGE_SIZE - 1) / GNTTAB_PAGE_SIZE;
+    gnttab_table = pmm_alloc_pages(pmm_order(max_grant_frames));
+    gnttab_list = pmm_alloc_pages(pmm_order(list_pages));
+    if (!gnttab_table || !gnttab_list) {
+        printf("cannot allocate gnttab_table!");
+        while (1) {} // halt the system
+    }
+
+    nr_grant_frames = 0;
+    gnttab_free_head = GRANT_INVALID_REF;
+    if (gnttab_grow() < 0) {
+        printf("cannot map gnttab_table!");
+        while (1) {} // halt the system
+    }
+
+    printf("gnttab_table mapped at %p (up to %d frames).\n", gnttab_table,
+            max_grant_frames);
+}
+
+/*
+ * Batched grant mapping: callers fill arrays of map/unmap ops (see
+ * gnttab_set_map_op() and gnttab_set_unmap_op()), which are handed to Xen
+ * in a single hypercall; Xen reports the outcome of each entry in its
+ * status field.
+ */
+void
+gnttab_set_map_op(struct gnttab_map_grant_ref *op, uint64_t host_addr,
+        uint32_t flags, grant_ref_t ref, domid_t domid)
+{
+    op->host_addr = host_addr;
+    op->flags = flags;
+    op->ref = ref;
+    op->dom = domid;
+    op->status = GNTST_general_error;
+}
+
+void
+gnttab_set_unmap_op(struct gnttab_unmap_grant_ref *op, uint64_t host_addr,
+        grant_handle_t handle)
+{
+    op->host_addr = host_addr;
+    op->dev_bus_addr = 0;
+    op->handle = handle;
+    op->status = GNTST_general_error;
+}
+
+/*
+ * Returns 0 if every entry was mapped, the number of failed entries
+ * otherwise (check their status), or a negative error if the hypercall
+ * itself failed.
+ */
+int
+gnttab_map_batch(struct gnttab_map_grant_ref *ops, unsigned int count)
+{
+    unsigned int i;
+    int rc, failed = 0;
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, ops, count);
+    if (rc)
+        return rc;
+    for (i = 0; i < count; i++)
+        if (ops[i].status != GNTST_okay)
+            failed++;
+    return failed;
+}
+
+int
+gnttab_unmap_batch(struct gnttab_unmap_grant_ref *ops, unsigned int count)
+{
+    unsigned int i;
+    int rc, failed = 0;
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, ops, count);
+    if (rc)
+        return rc;
+    for (i = 0; i < count; i++)
+        if (ops[i].status != GNTST_okay)
+            failed++;
+    return failed;
 }
 
 void
@@ -15,6 +15,18 @@
 #include <memory.h>
 #include <rdtsc.h>
 #include <gnttab.h>
+#include <xring.h>
+#include <timer.h>
+#include <task.h>
+#include <string.h>
+#include <os.h>
+#include <pmm.h>
+#include <bootinfo.h>
+#include <vm.h>
+#include <smp.h>
+#include <msr.h>
+#include <trace.h>
+#include "userinc/sysnr.h"
 
 #define HYPERVISOR_XEN 0
 #define HYPERVISOR_NONE 4
@@ -23,10 +35,30 @@
 typedef unsigned long long u64;
 typedef __INT64_TYPE__ bmk_time_t;
 
+/*
+ * Build with -DKERNEL_PT_4K to identity-map the kernel's 4GB with 4KB pages
+ * only (as before); by default, 2MB/1GB pages are used.
+ * Keep in sync with KERNEL_PT_PAGES in boot.c.
+ */
+#ifdef KERNEL_PT_4K
+# define KERNEL_PTES 1048576
+#else
+# define KERNEL_PTES 512
+#endif
+
 void *default_trap_ptr;
 void *pagefault_trap_ptr;
-void *rsp_base_addr;
 void *timer_apic_ptr;
+void *ipi_apic_ptr;
+
+/* Shared by all user address spaces, see setup_user_pagetable() */
+u64 *kernel_pdp;
+
+//Every task runs the same image, at most this many times
+#define USER_TASKS 2
+
+//Each address space has its TLS page here, FS points to it
+#define TLS_ADDR (USER_BASE + 510 * 0x1000)
 
 // Write to the CR3 register with the base address of the PML4 Table
 
@@ -45,9 +77,10 @@ void page_table(u64 *p, void *user_buffer, u64 stack_pointer_base, int type, int
 	//kernel
 	if (type == 0)
 	{
-		for (int i = 0; i < 1048576; i++)
+		for (int i = 0; i < KERNEL_PTES; i++)
 		{
-			p[i] = (next_page + 0x3);
+			//global: kept in the TLB across CR3 reloads
+			p[i] = (next_page + 0x103);
 
 			next_page += 0x1000;
 		}
@@ -183,8 +216,86 @@ void pml4_table(u64 *pml4, u64 *pdp, u64 *pdp_kernel, int type)
 	}
 }
 
+#ifndef KERNEL_PT_4K
+
+/*
+ * Large-page kernel mapping.
+ *
+ * The first 2MB are still mapped with 4KB pages since the legacy
+ * region below 1MB is covered by fixed-range MTRRs of different types.
+ * Everything else is mapped with 2MB pages, or 1GB pages for GB 1..3
+ * when the CPU supports them.
+ */
+
+int cpu_has_1g_pages(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	x86_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	if (eax < 0x80000001)
+		return 0;
+
+	x86_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+	return (edx & (1U << 26)) != 0; /* Page1GB */
+}
+
+void page_directory_large(u64 *pd, u64 *p, int num)
+{
+	u64 next_page = 0x0;
+
+	for (int j = 0; j < num; j++)
+	{
+		//first 2MB via the 4KB page table
+		if (j == 0)
+		{
+			pd[j] = (u64)p + 0x3;
+		}
+
+		//present, writable, 2MB page, global
+		else
+		{
+			pd[j] = next_page + 0x183;
+		}
+		next_page += 0x200000;
+	}
+}
+
+void page_directory_pointer_large(u64 *pdp, u64 *pd, int huge)
+{
+	u64 next_page = 0x0;
+
+	for (int j = 0; j < 512; j++)
+	{
+		//first 4 entries in kernel
+		if (j < 4)
+		{
+			//present, writable, 1GB page, global
+			if (huge && j != 0)
+			{
+				pdp[j] = next_page + 0x183;
+			}
+			else
+			{
+				u64 *start_pde = pd + 512 * j;
+				u64 page_addr = (u64)start_pde;
+				pdp[j] = page_addr + 0x3;
+			}
+		}
+
+		//other entries are null
+		else
+		{
+			pdp[j] = 0x0ULL;
+		}
+		next_page += 0x40000000;
+	}
+}
+
+#endif
+
 u64 *setup_kernel_pagetable(void *addr)
 {
+#ifdef KERNEL_PT_4K
 	//PTE
 	u64 *p = (u64 *)addr;
 	page_table(p, NULL, 0, 0, 0);
@@ -196,6 +307,21 @@ u64 *setup_kernel_pagetable(void *addr)
 	//PDPE
 	u64 *pdp = (pd + 2048);
 	page_directory_pointer(pdp, pd, 0);
+#else
+	int huge = cpu_has_1g_pages();
+
+	//PTE (first 2MB only)
+	u64 *p = (u64 *)addr;
+	page_table(p, NULL, 0, 0, 0);
+
+	//PDE (only the first GB with 1GB pages)
+	u64 *pd = (p + 512);
+	page_directory_large(pd, p, huge ? 512 : 2048);
+
+	//PDPE
+	u64 *pdp = (pd + (huge ? 512 : 2048));
+	page_directory_pointer_large(pdp, pd, huge);
+#endif
 
 	//PML4E
 	u64 *pml4 = (pdp + 512);
@@ -209,40 +335,94 @@ u64 *setup_kernel_pagetable(void *addr)
 	return pdp;
 }
 
-void setup_user_pagetable(void *addr, u64 *pdp_kernel, void *user_buffer, int user_pages)
+struct tls_block
+{
+	struct tls_block *myself;
+	char padding[4096 - 8];
+};
+
+//Builds a user address space around the image at user_buffer
+void setup_user_pagetable(struct vm_space *vm, void *user_buffer, int user_pages)
 {
 
 	//PTE
-	u64 *p = (u64 *)addr;
-	u64 stack_pointer_base = (u64)(addr - 0x1000);
+	u64 *p = pmm_alloc_page();
+	u64 stack_pointer_base = (u64)pmm_alloc_page();
 	page_table(p, user_buffer, stack_pointer_base, 1, user_pages);
 
 	//PDE
-	u64 *pd = (p + 512);
+	u64 *pd = pmm_alloc_page();
 	page_directory(pd, p, 1);
 
 	//PDPE
-	u64 *pdp = (pd + 512);
+	u64 *pdp = pmm_alloc_page();
 	page_directory_pointer(pdp, pd, 1);
 
 	//PML4E
-	u64 *pml4 = (pdp + 512);
-	pml4_table(pml4, pdp, pdp_kernel, 1);
+	u64 *pml4 = pmm_alloc_page();
+	pml4_table(pml4, pdp, kernel_pdp, 1);
+
+	//TLS page
+	struct tls_block *tls = pmm_alloc_zeroed_page();
+	tls->myself = (struct tls_block *)TLS_ADDR;
+	p[510] = (u64)tls + 0x7;
+
+	//Demand-paged regions: the stack grows down from its first page,
+	//everything past the image (heap) up to the fixed kernel-mapped pages
+	vm->pml4 = pml4;
+	vm->nr_regions = 0;
+	vm_add_region(vm, USER_START, USER_BASE + 0x1000, PTE_W | PTE_U);
+	vm_add_region(vm, USER_BASE + (user_pages + 1) * 0x1000, USER_FIXED_BASE, PTE_W | PTE_U);
+}
 
-	//CR3 register
-	u64 *start_pml4e = pml4;
-	u64 page_addr = (u64)start_pml4e;
-	write_cr3(page_addr);
+void setup_pagetable(void *addr)
+{
+	kernel_pdp = setup_kernel_pagetable(addr);
+	printf("Allocated initial kernel page table.\n");
+	vm_init_tlb();
 }
 
-void setup_pagetable(void *addr, void *user_addr, void *user_buffer, int user_pages)
+//Enables the AVX register state (XCR0: x87, SSE, AVX) when the CPU has it,
+//the APs copy CR4 and XCR0 from the boot CPU
+void xsave_init(void)
 {
+	uint32_t eax, ebx, ecx, edx;
 
-	u64 *pdp_kernel = setup_kernel_pagetable(addr);
-	printf("Allocated initial kernel page table.\n");
+	x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & (1U << 26)) || !(ecx & (1U << 28))) //XSAVE, AVX
+		return;
+	write_cr4(read_cr4() | CR4_OSXSAVE);
+	xsetbv(0, xgetbv(0) | 0x7);
+}
+
+//Makes the framebuffer write-combining in the identity map itself, so
+//that no uncached alias of it remains
+void map_framebuffer_wc(unsigned int *fb, size_t size)
+{
+	u64 *pml4 = kernel_pdp + 512; //see setup_kernel_pagetable()
 
-	setup_user_pagetable(user_addr, pdp_kernel, user_buffer, user_pages);
-	printf("Allocated new page table containing user.\n\n");
+	if (vm_set_cache(pml4, (u64)fb, (u64)fb + size, PTE_WC) != 0)
+		printf("Cannot map the framebuffer write-combining!\n");
+}
+
+//A new task running its own copy of the user image
+struct task *spawn_user(void *user_buffer, int user_pages)
+{
+	struct task *t = task_alloc();
+	void *image = pmm_alloc_pages(pmm_order(user_pages));
+
+	if (!t || !image)
+	{
+		printf("Cannot create a user task!\n");
+		return NULL;
+	}
+	memcpy(image, user_buffer, user_pages * 0x1000);
+	setup_user_pagetable(&t->vm, image, user_pages);
+
+	//The image starts right above the first stack page
+	task_start_user(t, USER_BASE + 0x1000, USER_BASE + 0x1000);
+	sched_add(t);
+	return t;
 }
 
 void init_idt_table(int num, void *ptr)
@@ -277,10 +457,18 @@ void x86_initidt()
 		{
 			init_idt_table(i, default_trap_ptr);
 		}
-		else if (i == 40)
+		else if (i == TIMER_VECTOR)
 		{
 			init_idt_table(i, timer_apic_ptr);
 		}
+		else if (i == APIC_IPI_VECTOR)
+		{
+			init_idt_table(i, ipi_apic_ptr);
+		}
+		else if (i == EVTCHN_VECTOR)
+		{
+			init_idt_table(i, evtchn_trap_ptr);
+		}
 		else
 		{
 			init_idt_table(i, 0);
@@ -301,57 +489,41 @@ void default_handler(void *rsp)
 {
 	printf("RSP pointer: %p\n", (u64)rsp);
 }
-void pagefault_handler()
+void pagefault_handler(u64 error)
 {
-	u64 base_addr = (u64)rsp_base_addr;
-	u64 pte = base_addr - 0x5000;
-	u64 *pte_ptr = (u64 *)pte;
-	u64 new_page_addr = base_addr - 0x1000;
-	pte_ptr[511] = new_page_addr + 0x7;
-
-	u64 pml4_addr = (u64)(new_page_addr - 0x1000);
-	write_cr3(pml4_addr);
+	u64 addr = read_cr2();
 
-	printf("Page fault handled! \n");
+	trace(TRACE_FAULT, addr, error);
+	if (vm_fault(&current_task->vm, addr, error) != 0)
+	{
+		printf("Unhandled page fault at %p, error: %x\n", addr, (unsigned)error);
+		while (1)
+		{
+		}; // halt the system
+	}
 }
 
 void interrupt_and_tss_setup(void *rsp0_stack)
 {
 	init_tss_segment(rsp0_stack);
+	this_cpu()->tss = rsp0_stack;
 	load_tss_segment((u64)(0x28), (tss_segment_t *)rsp0_stack);
 	x86_initidt();
 	idt_pointer_init();
 }
 
-void tls_setup(void *addr)
+void tss_set_rsp0(void *rsp0)
 {
-	u64 base_addr = (u64)addr;
-	u64 pte = base_addr;
-	u64 *pte_ptr = (u64 *)pte;
-	u64 new_page_addr = base_addr + 0x7000;
-	pte_ptr[510] = new_page_addr + 0x7;
-
-	u64 pml4_addr = (u64)(base_addr + 0x3000);
-	write_cr3(pml4_addr);
-
-	printf("tls page mapped!");
+	((tss_segment_t *)this_cpu()->tss)->rsp[0] = (u64)rsp0;
 }
 
-struct tls_block
-{
-	struct tls_block *myself;
-	char padding[4096 - 8];
-};
-
+//tls->myself is filled in by setup_user_pagetable()
 void set_tls_info(void *addr)
 {
-	struct tls_block *tls = (struct tls_block *)addr;
+	unsigned long p = (unsigned long)addr;
 
-	unsigned long p = (unsigned long)tls;
-
-	tls->myself = tls;
 	__asm__ __volatile__("wrmsr" ::
-							 "c"(0xc0000100),
+							 "c"(MSR_FS_BASE),
 						 "a"((unsigned)(p)),
 						 "d"((unsigned)(p >> 32)));
 }
@@ -361,6 +533,26 @@ void set_fs(void *addr)
 	set_tls_info(addr);
 }
 
+//An AP gets its own copy of the GDT since ltr marks the TSS descriptor busy,
+//and shares the IDT; the TSS follows the AP's interrupt stack page
+void ap_interrupt_and_tss_setup(struct cpu *c)
+{
+	void *rsp0_stack = pmm_alloc_pages(1) + 0x1000;
+	struct
+	{
+		uint16_t limit;
+		uint64_t base;
+	} __attribute__((__packed__)) gdt_ptr = {sizeof(c->gdt) - 1, (uint64_t)c->gdt};
+
+	memcpy(c->gdt, gdt, 5 * sizeof(uint64_t));
+	init_tss_segment(rsp0_stack);
+	set_tss_descriptor(c->gdt, 0x28, (tss_segment_t *)rsp0_stack);
+	c->tss = rsp0_stack;
+	__asm__ __volatile__("lgdt %0; ltr %w1" ::"m"(gdt_ptr), "r"(0x28));
+	idt_pointer_init();
+	set_fs((void *)TLS_ADDR);
+}
+
 /* 
 
 Detect XEN hypervisor
@@ -458,6 +650,8 @@ shared_init(void)
 		printf("cannot get shared info\n");
 }
 
+static uint32_t xen_base; //the Xen CPUID leaves, 0 without Xen
+
 void initialize_hypercalls()
 {
 	uint32_t eax, ebx, ecx, edx;
@@ -466,7 +660,7 @@ void initialize_hypercalls()
 	if (hypervisor_detect() != HYPERVISOR_XEN)
 		return;
 
-	uint32_t xen_base = hypervisor_base(HYPERVISOR_XEN);
+	xen_base = hypervisor_base(HYPERVISOR_XEN);
 	if (!xen_base)
 		return;
 
@@ -520,6 +714,8 @@ struct pvclock_vcpu_time_info
 	uint8_t pad[2];
 } __attribute__((__packed__));
 
+#define PVCLOCK_TSC_STABLE_BIT 0x1 //the TSCs of all vCPUs are synchronized
+
 /* Xen/KVM wall clock ABI. */
 struct pvclock_wall_clock
 {
@@ -545,27 +741,28 @@ mul64_32(uint64_t a, uint32_t b)
 	return prod;
 }
 
+//'ti' must be the record of the vCPU running this code, unless the TSC is stable
 static inline bmk_time_t
-_pvclock_monotonic(void)
+_pvclock_monotonic(volatile struct pvclock_vcpu_time_info *ti)
 {
 	uint32_t version;
 	uint64_t delta, time_now;
 
 	do
 	{
-		version = pvclock_ti->version;
+		version = ti->version;
 		__asm__("mfence" ::
 					: "memory");
-		delta = rdtsc() - pvclock_ti->tsc_timestamp;
-		if (pvclock_ti->tsc_shift < 0)
-			delta >>= -pvclock_ti->tsc_shift;
+		delta = rdtsc() - ti->tsc_timestamp;
+		if (ti->tsc_shift < 0)
+			delta >>= -ti->tsc_shift;
 		else
-			delta <<= pvclock_ti->tsc_shift;
-		time_now = mul64_32(delta, pvclock_ti->tsc_to_system_mul) +
-				   pvclock_ti->system_time;
+			delta <<= ti->tsc_shift;
+		time_now = mul64_32(delta, ti->tsc_to_system_mul) +
+				   ti->system_time;
 		__asm__("mfence" ::
 					: "memory");
-	} while ((pvclock_ti->version & 1) || (pvclock_ti->version != version));
+	} while ((ti->version & 1) || (ti->version != version));
 
 	return (bmk_time_t)time_now;
 }
@@ -592,12 +789,91 @@ pvclock_read_wall_clock(void)
 	return wc_boot;
 }
 
+/*
+ * TSC frequency implied by the PV clock scale:
+ * ns = ((tsc << tsc_shift) * tsc_to_system_mul) >> 32
+ */
+static uint64_t
+pvclock_tsc_hz(void)
+{
+	uint64_t hz = (NSEC_PER_SEC << 32) / pvclock_ti->tsc_to_system_mul;
+
+	if (pvclock_ti->tsc_shift < 0)
+		hz <<= -pvclock_ti->tsc_shift;
+	else
+		hz >>= pvclock_ti->tsc_shift;
+	return hz;
+}
+
+/*
+
+User-mapped PV clock (vDSO-style)
+
+*/
+
+//Where the shared info page is mapped (read-only) in the user address space
+#define VCLOCK_ADDR (USER_FIXED_BASE + 0x1000)
+
+static long sys_vclock_setup(long a1, long a2, long a3, long a4, long a5)
+{
+	struct vclock_info *info = (struct vclock_info *)a1;
+	u64 shared = (u64)HYPERVISOR_shared_info;
+
+	if (!user_range_writable(a1, sizeof(struct vclock_info)))
+		return SYSCALL_EFAULT;
+
+	//Tasks migrate between CPUs but only read vCPU 0's record
+	if (!(pvclock_ti->flags & PVCLOCK_TSC_STABLE_BIT))
+		return SYSCALL_EOPNOTSUPP;
+
+	//Xen keeps updating the page, the user only reads it
+	if (vm_map_page(current_task->vm.pml4, VCLOCK_ADDR, shared, PTE_U) != 0)
+		return SYSCALL_ENOMEM;
+	invlpg(VCLOCK_ADDR);
+
+	info->time_info = VCLOCK_ADDR + ((u64)pvclock_ti - shared);
+	info->wall_clock = VCLOCK_ADDR + ((u64)pvclock_wc - shared);
+	return 0;
+}
+
+//The fallback of the user clock: this CPU's own record and TSC
+static long sys_clock_monotonic(long a1, long a2, long a3, long a4, long a5)
+{
+	struct cpu *c = this_cpu();
+
+	if (!HYPERVISOR_shared_info)
+		return SYSCALL_EOPNOTSUPP;
+	return _pvclock_monotonic((struct pvclock_vcpu_time_info *)
+		&HYPERVISOR_shared_info->vcpu_info[c->vcpu_id].time);
+}
+
+//Xen numbers the vCPUs on its own, CPUID tells each CPU which one it is
+void pvclock_init_cpu(void)
+{
+	struct cpu *c = this_cpu();
+	uint32_t eax, ebx, ecx, edx;
+	unsigned int max = sizeof(HYPERVISOR_shared_info->vcpu_info) /
+		sizeof(HYPERVISOR_shared_info->vcpu_info[0]);
+
+	c->vcpu_id = 0;
+	if (!xen_base)
+		return;
+	x86_cpuid(xen_base + 4, &eax, &ebx, &ecx, &edx);
+	if ((eax & 0x8) && ebx < max)
+		c->vcpu_id = ebx;
+	else if (c->id != 0)
+		printf("CPU %d: unknown Xen vCPU, using vCPU 0's clock\n", (int)c->id);
+}
+
 void pvclock_init()
 {
 	pvclock_ti = (struct pvclock_vcpu_time_info *)&HYPERVISOR_shared_info->vcpu_info[0].time;
 	pvclock_wc = (struct pvclock_wall_clock *)&HYPERVISOR_shared_info->wc_version;
+	syscall_register(SYS_vclock_setup, sys_vclock_setup);
+	syscall_register(SYS_clock_monotonic, sys_clock_monotonic);
+	pvclock_init_cpu();
 
-	_x86_cpu_clock_monotonic = _pvclock_monotonic();
+	_x86_cpu_clock_monotonic = _pvclock_monotonic(pvclock_ti);
 	printf("\ninitial monotonic clock:%ld\n", _x86_cpu_clock_monotonic);
 
 	rtc_epochoffset = pvclock_read_wall_clock();
@@ -605,7 +881,7 @@ void pvclock_init()
 
 	while (1)
 	{
-		_x86_cpu_clock_monotonic_2 = _pvclock_monotonic();
+		_x86_cpu_clock_monotonic_2 = _pvclock_monotonic(pvclock_ti);
 		rtc_epochoffset = pvclock_read_wall_clock();
 		if ((_x86_cpu_clock_monotonic_2 - _x86_cpu_clock_monotonic) >= 1000000000)
 		{
@@ -619,55 +895,232 @@ void pvclock_init()
 }
 /*
 
+Ring channel to the other domain (part2_q1 is the back end)
+
+*/
+struct xring ring_chan;
+
+#define RING_REQUESTS	8
+#define RING_TIMEOUT_NS	(100 * NSEC_PER_MSEC)
+
+static int ring_sent, ring_answered;
+static volatile int ring_done; //1: all answered, -1: timed out
+
+//Reap the back end's responses
+static void ring_channel_event(evtchn_port_t port, void *data)
+{
+	while (xring_get_response(&ring_chan) != NULL)
+		ring_answered++;
+	if (ring_answered == ring_sent)
+		ring_done = 1;
+}
+
+static void ring_channel_timeout(struct timer *t, void *data)
+{
+	ring_done = -1;
+}
+
+void ring_channel_init(char *shared_page)
+{
+	struct xring_bootstrap *boot = (struct xring_bootstrap *)(shared_page + XRING_BOOTSTRAP_OFFSET);
+	grant_ref_t ring_ref;
+	struct xring_msg *msg;
+	struct timer timeout;
+	int bound;
+
+	void *ring_page = pmm_alloc_zeroed_page();
+	if (!ring_page || xring_front_init(&ring_chan, ring_page, (domid_t)77, &ring_ref) != 0)
+	{
+		printf("Cannot set up the ring channel!\n");
+		return;
+	}
+
+	//Queue a few requests, the back end gets a single notification
+	for (int i = 0; i < RING_REQUESTS; i++)
+	{
+		msg = xring_req_slot(&ring_chan);
+		if (!msg)
+			break;
+		msg->id = i;
+		msg->len = 4;
+		*(uint32_t *)msg->data = i * i;
+		ring_sent++;
+	}
+	bound = evtchn_bind(ring_chan.port, ring_channel_event, NULL) == 0;
+	xring_push_requests(&ring_chan);
+
+	//Tell the other side where the ring is, magic last: only now, since
+	//the back end drains the ring once, as soon as it attaches
+	boot->ring_ref = ring_ref;
+	boot->port = ring_chan.port;
+	wmb();
+	boot->magic = XRING_MAGIC;
+	printf("Ring channel: ref %d, port %d\n", ring_ref, ring_chan.port);
+	if (!bound)
+	{
+		printf("Ring channel: no event channel upcalls!\n");
+		return;
+	}
+
+	//Sleep until the responses arrive, or give up on the back end
+	timer_setup(&timeout, ring_channel_timeout, NULL);
+	if (timer_arm(&timeout, RING_TIMEOUT_NS) != 0)
+		return;
+	evtchn_wait(&ring_done);
+	timer_cancel(&timeout);
+	printf("Ring channel: %d of %d requests answered\n", ring_answered, ring_sent);
+	if (ring_done < 0)
+		evtchn_unbind(ring_chan.port);
+}
+
+/*
+
 Initializing the shared memory
 */
-void shared_memory_init(void *addr)
+void shared_memory_init(void)
 {
-	gnttab_table = addr;
 	init_gnttab();
-	char *shared_page = addr + 0x1000;
+	char *shared_page = pmm_alloc_page();
 	shared_page[0]='H';
 	shared_page[1]='I';
 	shared_page[2]='\0';
 	printf("\nWriting a message: %s\n", shared_page);
 	
 	unsigned long frame = (unsigned long)shared_page / 4096;
-	grant_ref_t ref = gnttab_grant_access((domid_t)77, frame, 0);
+	grant_ref_t ref = gnttab_grant_bootstrap((domid_t)77, frame, 0);
+	if (ref == GRANT_INVALID_REF)
+	{
+		printf("Out of grant entries!\n");
+		return;
+	}
 	printf("Grant ref id: %d\n",ref);
-	
+
+	ring_channel_init(shared_page);
+}
+
+// Boot checkpoints (see bootinfo.h), the boot loader fills in its own
+static struct boot_info *boot_info;
+
+static const char boot_stage_names[BOOT_STAGES][24] = {
+	"efi_main", "files opened", "KERNEL read", "KERNEL loaded",
+	"graphics mode", "USER read", "ExitBootServices", "kernel_start",
+	"page table", "interrupts, scheduler", "hypercalls", "pvclock",
+	"timer", "event channels", "tasks, APs", "sched_start"
+};
+
+static void boot_checkpoint(int stage)
+{
+	boot_info->boot_tsc[stage] = rdtsc();
 }
 
-void kernel_start(void *addr, unsigned int *fb, int width, void *user_addr, void *user_buffer, int user_pages)
+// pvclock/CPUID TSC rate if known, otherwise the boot loader's estimate
+static uint64_t boot_tsc_to_us(uint64_t tsc)
 {
-	fb_init(fb, width, 600);
+	if (timer_tsc_hz())
+		return timer_tsc_to_ns(tsc) / NSEC_PER_USEC;
+	return boot_info->tsc_khz ? tsc * 1000 / boot_info->tsc_khz : 0;
+}
 
-	setup_pagetable(addr, user_addr, user_buffer, user_pages);
+static void boot_report(void)
+{
+	uint64_t start = boot_info->boot_tsc[BOOT_EFI_ENTRY], prev = start;
+
+	printf("  %-22s %10s %10s\n", "boot stage (us)", "total", "delta");
+	for (int i = 0; i < BOOT_STAGES; i++)
+	{
+		uint64_t tsc = boot_info->boot_tsc[i];
+		if (tsc == 0)
+			continue;
+		printf("  %-22s %10lu %10lu\n", boot_stage_names[i],
+			boot_tsc_to_us(tsc - start), boot_tsc_to_us(tsc - prev));
+		prev = tsc;
+	}
+}
+
+// The first module named 'name', NULL if the boot loader did not load it
+static struct boot_module *boot_module(struct boot_info *bi, const char *name)
+{
+	for (unsigned int i = 0; i < bi->nr_modules && i < BOOT_MAX_MODULES; i++)
+	{
+		const char *m = bi->modules[i].name, *n = name;
+		while (*m && *m == *n)
+		{
+			m++;
+			n++;
+		}
+		if (*m == *n)
+			return &bi->modules[i];
+	}
+	return NULL;
+}
 
-	u64 jump_addr = 0xFFFFFFFFC0000000;
-	user_stack = (void *)(jump_addr + 0x1000);
-	void * rsp0_stack = user_addr + 0x5000 + 0x1000; //end of stack
-	rsp_base_addr = (void *)(rsp0_stack - 0x1000);
+void kernel_start(struct boot_info *bi)
+{
+	// Nothing can be trusted, not even the framebuffer, with another layout
+	if (bi->magic != BOOT_INFO_MAGIC || bi->version != BOOT_INFO_VERSION ||
+		bi->size < sizeof(struct boot_info))
+	{
+		while (1) {} // halt the system
+	}
 
-	void *ptr = (void *)0xFFFFFFFFC01FE000;
+	unsigned int *fb = (unsigned int *)bi->fb_base;
+	boot_info = bi;
+	boot_checkpoint(BOOT_KERNEL_ENTRY);
+	fb_init(fb, bi->fb_width, bi->fb_height, bi->fb_pitch);
+
+	// The firmware's page tables live in boot-services memory, which
+	// pmm_init() hands out, so leave them before the allocator exists
+	setup_pagetable((void *)bi->kernel_stack);
+	pmm_init(bi);
+	smp_init_bsp();
+	boot_checkpoint(BOOT_PAGETABLE);
+	xsave_init();
+	map_framebuffer_wc(fb, (size_t)bi->fb_pitch * bi->fb_height * sizeof(*fb));
+	fb_init_shadow();
+	printf("Boot info v%d: %dx%d framebuffer (pitch %d), RSDP %p, %d module(s)\n",
+		bi->version, bi->fb_width, bi->fb_height, bi->fb_pitch, (void *)bi->rsdp, bi->nr_modules);
+
+	void * rsp0_stack = pmm_alloc_pages(1) + 0x1000; //end of stack, followed by tss
 
 	syscall_init();
 	interrupt_and_tss_setup(rsp0_stack);
-	//x86_lapic_enable();
-	//apic_init();
-	tls_setup(user_addr);
-	set_fs(ptr);
+	x86_lapic_enable();
+	sched_init();
+	trace_init();
+	set_fs((void *)TLS_ADDR);
+	boot_checkpoint(BOOT_INTERRUPTS);
 
 	unsigned i = hypervisor_detect();
 	printf("\nXen Hypervisor detect: %d\n", i);
 	initialize_hypercalls();
 	print_xen_version();
+	boot_checkpoint(BOOT_HYPERCALLS);
 	pvclock_init();
-	shared_memory_init(user_addr + 0x8000);
+	boot_checkpoint(BOOT_PVCLOCK);
+	timer_init(HYPERVISOR_shared_info ? pvclock_tsc_hz() : 0);
+	boot_checkpoint(BOOT_TIMER);
+	fb_benchmark();
+	printf_benchmark();
+	evtchn_init();
+	shared_memory_init();
+	boot_checkpoint(BOOT_EVTCHN);
+
+	struct boot_module *user = boot_module(bi, "USER");
+	if (user)
+	{
+		for (int t = 0; t < USER_TASKS; t++)
+			spawn_user((void *)user->base, (user->size + 0xFFF) / 0x1000);
+	}
+	else
+	{
+		printf("No USER module, nothing to run!\n");
+	}
+	smp_boot_aps(bi->rsdp);
+	boot_checkpoint(BOOT_SMP);
 
-	user_jump(user_stack);
+	boot_checkpoint(BOOT_USER_JUMP);
+	boot_report();
 
-	/* Never exit! */
-	while (1)
-	{
-	};
+	/* Never exits, the boot stack becomes the idle task's */
+	sched_start();
 }
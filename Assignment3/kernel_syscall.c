@@ -2,31 +2,122 @@
 #include <types.h>
 #include <printf.h>
 #include <msr.h>
+#include <rdtsc.h>
+#include <vm.h>
+#include <pmm.h>
+#include <sysring.h>
+#include <trace.h>
+#include <smp.h>
+#include <task.h>
+#include "userinc/sysnr.h"
 
 
 void *kernel_stack; /* Initialized in kernel_entry.S */
-void *user_stack;
-//= (void *)(0xFFFFFFFFC0001000); /* TODO: Must be initialized to a user stack region */
 
 void *syscall_entry_ptr; /* Points to syscall_entry(), initialized in kernel_entry.S; use that rather than syscall_entry() when obtaining its address */
 
+/*
+ * The dispatch table is filled in by syscall_register() from each
+ * subsystem's init function, so the subsystems stay self-contained
+ */
+static syscall_fn_t syscall_table[NR_SYSCALLS];
+/* Per-CPU counters: no atomics or shared cache lines on the syscall path */
+static struct syscall_stat syscall_stats[SMP_MAX_CPUS][NR_SYSCALLS];
 
+static int user_range_access(long addr, unsigned long size, uint64_t flags)
+{
+	uint64_t start = (uint64_t) addr;
+
+	/* Page permissions, not just the range: e.g. the vclock page is read-only */
+	return start >= USER_START && size <= 0 - start &&
+		vm_user_access(&current_task->vm, start, size, flags);
+}
+
+int user_range_ok(long addr, unsigned long size)
+{
+	return user_range_access(addr, size, PTE_U);
+}
+
+int user_range_writable(long addr, unsigned long size)
+{
+	return user_range_access(addr, size, PTE_U | PTE_W);
+}
+
+static long sys_nop(long a1, long a2, long a3, long a4, long a5)
+{
+	return 0;
+}
+
+static long sys_print(long a1, long a2, long a3, long a4, long a5)
+{
+	const char *s = (const char *) a1;
+
+	/* Every page up to and including the NUL must be user memory */
+	if (!user_range_ok(a1, 1))
+		return SYSCALL_EFAULT;
+	while (*s) {
+		s++;
+		if (((uint64_t) s & (PAGE_SIZE - 1)) == 0 && !user_range_ok((long) s, 1))
+			return SYSCALL_EFAULT;
+	}
+
+	//Print the string
+	printf("\n%s\n", a1);
+	return 0;
+}
+
+static long sys_syscall_stats(long a1, long a2, long a3, long a4, long a5)
+{
+	struct syscall_stat *buf = (struct syscall_stat *) a1;
+	unsigned long i, num = (unsigned long) a2;
+	unsigned int cpu;
+
+	if (num > NR_SYSCALLS)
+		num = NR_SYSCALLS;
+	if (!user_range_writable(a1, num * sizeof(struct syscall_stat)))
+		return SYSCALL_EFAULT;
+
+	for (i = 0; i < num; i++) {
+		buf[i].calls = 0;
+		buf[i].cycles = 0;
+		for (cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			buf[i].calls += syscall_stats[cpu][i].calls;
+			buf[i].cycles += syscall_stats[cpu][i].cycles;
+		}
+	}
+	return num;
+}
+
+void syscall_register(long n, syscall_fn_t fn)
+{
+	syscall_table[n] = fn;
+}
 
 long do_syscall_entry(long n, long a1, long a2, long a3, long a4, long a5)
 {
-	// TODO: a system call handler
+	struct syscall_stat *stat;
+	uint64_t start;
+	long ret;
+
 	// the system call number is in 'n'
 	// make sure it is valid
-	
-	if(n==1)
-	{
-		//Print the string
-		printf("\n%s\n", a1);
-	}
-	return 0; /* Success */
+	if ((unsigned long) n >= NR_SYSCALLS || !syscall_table[n])
+		return SYSCALL_ENOSYS;
+
+	trace(TRACE_SYSCALL_ENTER, n, 0);
+	start = rdtsc();
+	ret = syscall_table[n](a1, a2, a3, a4, a5);
+	/* The handler may have blocked and resumed on another CPU */
+	stat = &syscall_stats[this_cpu()->id][n];
+	stat->cycles += rdtsc() - start;
+	stat->calls++;
+	trace(TRACE_SYSCALL_EXIT, n, ret);
+
+	return ret;
 }
 
-void syscall_init(void)
+/* The SYSCALL MSRs, on every CPU */
+void syscall_init_cpu(void)
 {
 	/* Enable SYSCALL/SYSRET */
 	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | 0x1);
@@ -41,3 +132,12 @@ void syscall_init(void)
 	/* Disable interrupts (IF) while in a syscall */
 	wrmsr(MSR_SFMASK, 1U << 9);
 }
+
+void syscall_init(void)
+{
+	syscall_init_cpu();
+	syscall_register(SYS_nop, sys_nop);
+	syscall_register(SYS_print, sys_print);
+	syscall_register(SYS_syscall_stats, sys_syscall_stats);
+	sysring_init();
+}
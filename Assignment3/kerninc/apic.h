@@ -13,14 +13,40 @@
 #define X86_LAPIC_DFR			0x0EU
 #define X86_LAPIC_SVR			0x0FU
 #define X86_LAPIC_ICR			0x30U
+#define X86_LAPIC_ICR_HIGH		0x31U
 
 #define X86_LAPIC_EOI			0x0BU
 #define X86_LAPIC_TIMER			0x32U
 #define X86_LAPIC_TIMER_INIT	0x38U
+#define X86_LAPIC_TIMER_CUR		0x39U
 #define X86_LAPIC_TIMER_DIVIDE	0x3EU
 
+#define X86_MSR_TSC_DEADLINE	0x6E0U
+
+/* Wakes a halted CPU to look for work, see task.c */
+#define APIC_IPI_VECTOR			41
+
+/* LVT timer modes */
+#define APIC_TIMER_ONESHOT		0x00000000U
+#define APIC_TIMER_PERIODIC		0x00020000U
+#define APIC_TIMER_TSC_DEADLINE	0x00040000U
+#define APIC_TIMER_MASKED		0x00010000U
+
 void x86_lapic_enable(void);
 void apic_handler(void);
-void apic_init(void);
+void apic_timer_setup(uint32_t vector, uint32_t mode);
+void apic_timer_oneshot(uint32_t count);
+void apic_timer_deadline(uint64_t tsc);
+uint32_t apic_timer_current(void);
+
+/* AP startup: INIT and STARTUP IPIs to all CPUs but this one */
+uint32_t apic_read_id(void);
+void apic_broadcast_init(void);
+void apic_broadcast_startup(uint32_t vector);
+
+/* A fixed IPI to one CPU */
+void apic_send_ipi(uint32_t apic_id, uint32_t vector);
+void apic_ipi_handler(void);
 
-extern void *timer_apic_ptr;
\ No newline at end of file
+extern void *timer_apic_ptr;
+extern void *ipi_apic_ptr;
\ No newline at end of file
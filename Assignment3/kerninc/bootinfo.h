@@ -0,0 +1,114 @@
+#pragma once
+
+/*
+ * Information passed from the boot loader (boot.c) to the kernel, which
+ * gets a pointer to it as its only argument.
+ *
+ * This header is shared by both sides, so only use fixed-size types here:
+ * 'long' is 32-bit in the boot loader (Microsoft ABI) but 64-bit in the kernel!
+ *
+ * Versioning: new fields go at the end and only grow 'size';
+ * BOOT_INFO_VERSION changes when existing fields move or change meaning.
+ */
+
+#define BOOT_INFO_MAGIC				0x4F464E49544F4F42ULL	/* "BOOTINFO" */
+#define BOOT_INFO_VERSION			1
+
+/* Used by kernel_entry.S */
+#define BOOT_INFO_KERNEL_STACK		16
+
+#ifndef __ASSEMBLER__
+
+/* EFI_MEMORY_TYPE values used by the kernel */
+#define EFI_LOADER_CODE				1
+#define EFI_LOADER_DATA				2
+#define EFI_BOOT_SERVICES_CODE		3
+#define EFI_BOOT_SERVICES_DATA		4
+#define EFI_CONVENTIONAL_MEMORY		7
+
+/* Same layout as EFI_MEMORY_DESCRIPTOR */
+struct efi_memory_descriptor {
+	unsigned int type;
+	unsigned int pad;
+	unsigned long long phys_start;
+	unsigned long long virt_start;
+	unsigned long long num_pages;
+	unsigned long long attribute;
+};
+
+/*
+ * Boot checkpoints: rdtsc values taken by the boot loader (up to
+ * BOOT_EXIT_BOOT_SERVICES) and then by the kernel, 0 if not reached
+ */
+#define BOOT_EFI_ENTRY				0	/* efi_main() */
+#define BOOT_FILES_OPENED			1	/* volume, KERNEL and USER open */
+#define BOOT_KERNEL_READ			2	/* KERNEL read (and expanded) */
+#define BOOT_KERNEL_LOADED			3	/* ELF segments placed */
+#define BOOT_GRAPHICS				4	/* SetGraphicsMode() */
+#define BOOT_USER_READ				5	/* USER read (and expanded) */
+#define BOOT_EXIT_BOOT_SERVICES		6	/* memory map, ExitBootServices() */
+#define BOOT_KERNEL_ENTRY			7	/* kernel_start() */
+#define BOOT_PAGETABLE				8	/* pmm_init(), setup_pagetable() */
+#define BOOT_INTERRUPTS				9	/* syscalls, IDT/TSS, LAPIC, scheduler */
+#define BOOT_HYPERCALLS				10	/* initialize_hypercalls() */
+#define BOOT_PVCLOCK				11	/* pvclock_init() */
+#define BOOT_TIMER					12	/* timer_init() */
+#define BOOT_EVTCHN					13	/* event channels, shared memory */
+#define BOOT_SMP					14	/* user tasks spawned, APs up */
+#define BOOT_USER_JUMP				15	/* sched_start(), off to user mode */
+#define BOOT_STAGES					16
+
+/* Framebuffer pixel layouts, same as EFI_GRAPHICS_PIXEL_FORMAT */
+#define BOOT_FB_RGBX				0
+#define BOOT_FB_BGRX				1
+
+/* Files loaded for the kernel, e.g. the user application ("USER") */
+#define BOOT_MAX_MODULES			4
+
+struct boot_module {
+	unsigned long long base;	/* page-aligned */
+	unsigned long long size;	/* in bytes */
+	char name[16];
+};
+
+struct boot_info {
+	unsigned long long magic;	/* BOOT_INFO_MAGIC */
+	unsigned int version;		/* BOOT_INFO_VERSION */
+	unsigned int size;			/* sizeof(struct boot_info) in the loader */
+
+	/* Top of the boot stack, the kernel's page-table pages start here */
+	unsigned long long kernel_stack;
+
+	/* The final memory map obtained right before ExitBootServices();
+	   descriptors are mmap_desc_size bytes apart (which may be larger
+	   than sizeof(struct efi_memory_descriptor)) */
+	unsigned long long mmap;
+	unsigned long long mmap_size;
+	unsigned long long mmap_desc_size;
+	unsigned int mmap_desc_version;
+	unsigned int pad;
+
+	/* Framebuffer: 'pitch' pixels (of 4 bytes) per scanline */
+	unsigned long long fb_base;
+	unsigned long long fb_size;
+	unsigned int fb_width;
+	unsigned int fb_height;
+	unsigned int fb_pitch;
+	unsigned int fb_format;
+
+	/* ACPI RSDP (2.0 if the firmware has it), 0 if none */
+	unsigned long long rsdp;
+
+	unsigned int nr_modules;
+	unsigned int pad2;
+	struct boot_module modules[BOOT_MAX_MODULES];
+
+	unsigned long long boot_tsc[BOOT_STAGES];
+	/* TSC frequency as measured by the boot loader against Stall() */
+	unsigned long long tsc_khz;
+};
+
+_Static_assert(__builtin_offsetof(struct boot_info, kernel_stack) == BOOT_INFO_KERNEL_STACK,
+	"kernel_entry.S relies on this");
+
+#endif /* !__ASSEMBLER__ */
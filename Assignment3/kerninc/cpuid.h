@@ -18,3 +18,22 @@ x86_cpuid(uint32_t level, uint32_t *eax_out, uint32_t *ebx_out,
 	*ecx_out = ecx_;
 	*edx_out = edx_;
 }
+
+/* Extended control registers, CR4.OSXSAVE must be set */
+static inline uint64_t
+xgetbv(uint32_t reg)
+{
+	uint32_t eax, edx;
+
+	__asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (reg));
+	return ((uint64_t) edx << 32) | eax;
+}
+
+static inline void
+xsetbv(uint32_t reg, uint64_t val)
+{
+	__asm__ __volatile__ ("xsetbv"
+		:
+		: "a" ((uint32_t) val), "d" ((uint32_t) (val >> 32)), "c" (reg)
+	);
+}
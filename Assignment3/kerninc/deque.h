@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+ * A bounded Chase-Lev work-stealing deque (Le et al., PPoPP'13), used as a
+ * FIFO: only the owning CPU pushes at the bottom, and every CPU, including
+ * the owner, takes items from the top with deque_steal(). The capacity is
+ * fixed, the caller must never have more than DEQUE_SIZE items in the deque.
+ */
+
+#include <types.h>
+
+#define DEQUE_SIZE		64		/* a power of two */
+
+struct deque {
+	int64_t top __attribute__((aligned(64)));
+	int64_t bottom __attribute__((aligned(64)));
+	void *buf[DEQUE_SIZE];
+};
+
+static inline void deque_push(struct deque *d, void *item)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&d->buf[b & (DEQUE_SIZE - 1)], item, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/* The oldest item; NULL if empty or if another CPU won the race for it */
+static inline void *deque_steal(struct deque *d)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	void *item;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+
+	item = __atomic_load_n(&d->buf[t & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return item;
+}
+
+static inline int deque_empty(struct deque *d)
+{
+	return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >=
+		__atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
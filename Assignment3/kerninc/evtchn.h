@@ -0,0 +1,62 @@
+#pragma once
+
+/*
+ * Event channels: binding operations and upcall dispatch (see evtchn.c)
+ */
+
+#include <types.h>
+#include <hypercall.h>
+#include <event_channel.h>
+
+/* Allocate a port that domain remote can bind to; 0 on success */
+static inline int evtchn_alloc_unbound(domid_t remote, evtchn_port_t *port)
+{
+	struct evtchn_alloc_unbound op;
+	int rc;
+
+	op.dom = DOMID_SELF;
+	op.remote_dom = remote;
+	rc = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound, &op);
+	if (rc == 0)
+		*port = op.port;
+	return rc;
+}
+
+/* Connect to a port allocated by domain remote; 0 on success */
+static inline int evtchn_bind_interdomain(domid_t remote, evtchn_port_t remote_port,
+		evtchn_port_t *local_port)
+{
+	struct evtchn_bind_interdomain op;
+	int rc;
+
+	op.remote_dom = remote;
+	op.remote_port = remote_port;
+	rc = HYPERVISOR_event_channel_op(EVTCHNOP_bind_interdomain, &op);
+	if (rc == 0)
+		*local_port = op.local_port;
+	return rc;
+}
+
+static inline int evtchn_notify(evtchn_port_t port)
+{
+	struct evtchn_send op;
+
+	op.port = port;
+	return HYPERVISOR_event_channel_op(EVTCHNOP_send, &op);
+}
+
+/* The IDT vector Xen delivers event upcalls to */
+#define EVTCHN_VECTOR	48
+#define EVTCHN_NR_PORTS	(sizeof(xen_ulong_t) * 8 * sizeof(xen_ulong_t) * 8)
+
+typedef void (*evtchn_handler_t)(evtchn_port_t port, void *data);
+
+extern void *evtchn_trap_ptr;
+
+int evtchn_init(void);
+int evtchn_bind(evtchn_port_t port, evtchn_handler_t handler, void *data);
+void evtchn_unbind(evtchn_port_t port);
+void evtchn_mask(evtchn_port_t port);
+void evtchn_unmask(evtchn_port_t port);
+void evtchn_do_upcall(void);
+void evtchn_wait(volatile int *done);
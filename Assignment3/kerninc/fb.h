@@ -1,11 +1,35 @@
 #pragma once
 
+#include <types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void fb_init(unsigned int *fb, unsigned int width, unsigned int height);
+/* pitch: pixels per scanline, at least width */
+void fb_init(unsigned int *fb, unsigned int width, unsigned int height,
+	unsigned int pitch);
 void fb_output(char ch);
+void fb_write(const char *str, size_t len);
+
+/*
+ * Render into a RAM copy of the screen from now on, after the framebuffer
+ * has been made write-combining
+ */
+void fb_init_shadow(void);
+
+/* Copy what changed since the last flush to the framebuffer */
+void fb_flush(void);
+
+/* Colours (0x00RRGGBB) of the characters that follow */
+void fb_set_color(uint32_t fg, uint32_t bg);
+
+/* Console output may use the SIMD registers, see fb.c */
+void fb_fpu_save(void);
+void fb_fpu_restore(void);
+
+/* With -DFB_BENCHMARK, print the glyph rate of each blitter */
+void fb_benchmark(void);
 
 #ifdef __cplusplus
 }
@@ -4,15 +4,35 @@
 #include <hypercall.h>
 #include <grant_table.h>
 
+/* Never handed out (reserved entry); returned when the table is full */
+#define GRANT_INVALID_REF 0
+
+/*
+ * The first page the two domains share is granted with this fixed ref, the
+ * only one the peer has to know in advance; refs for everything else are
+ * published in that page (see struct xring_bootstrap)
+ */
+#define GRANT_BOOTSTRAP_REF 511
+
 extern grant_entry_v1_t *gnttab_table;
 
 void init_gnttab(void);
 grant_ref_t gnttab_alloc_and_grant(void **map);
 grant_ref_t gnttab_grant_access(domid_t domid, unsigned long frame,
 				int readonly);
+/* Grant with GRANT_BOOTSTRAP_REF, which the free list never hands out */
+grant_ref_t gnttab_grant_bootstrap(domid_t domid, unsigned long frame,
+				int readonly);
 grant_ref_t gnttab_grant_transfer(domid_t domid, unsigned long pfn);
 unsigned long gnttab_end_transfer(grant_ref_t gref);
 int gnttab_end_access(grant_ref_t ref);
 void fini_gnttab(void);
 
+void gnttab_set_map_op(struct gnttab_map_grant_ref *op, uint64_t host_addr,
+		uint32_t flags, grant_ref_t ref, domid_t domid);
+void gnttab_set_unmap_op(struct gnttab_unmap_grant_ref *op, uint64_t host_addr,
+		grant_handle_t handle);
+int gnttab_map_batch(struct gnttab_map_grant_ref *ops, unsigned int count);
+int gnttab_unmap_batch(struct gnttab_unmap_grant_ref *ops, unsigned int count);
+
 #endif /* !__MINIOS_GNTTAB_H__ */
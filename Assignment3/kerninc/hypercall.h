@@ -38,6 +38,7 @@
 #include <sched.h>
 #include <memory.h>
 #include <version.h>
+#include <trace.h>
 
 #define __STR(x) #x
 #define STR(x) __STR(x)
@@ -50,6 +51,7 @@ extern char _minios_shared_info[];
 #define _hypercall0(type, name)			\
 ({						\
 	long __res;				\
+	trace(TRACE_HYPERCALL, __HYPERVISOR_##name, 0);	\
 	asm volatile (				\
 		"call _minios_hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res)			\
@@ -61,6 +63,7 @@ extern char _minios_shared_info[];
 #define _hypercall1(type, name, a1)				\
 ({								\
 	long __res, __ign1;					\
+	trace(TRACE_HYPERCALL, __HYPERVISOR_##name, (long)(a1));	\
 	asm volatile (						\
 		"call _minios_hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res), "=D" (__ign1)			\
@@ -72,6 +75,7 @@ extern char _minios_shared_info[];
 #define _hypercall2(type, name, a1, a2)				\
 ({								\
 	long __res, __ign1, __ign2;				\
+	trace(TRACE_HYPERCALL, __HYPERVISOR_##name, (long)(a1));	\
 	asm volatile (						\
 		"call _minios_hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res), "=D" (__ign1), "=S" (__ign2)	\
@@ -83,6 +87,7 @@ extern char _minios_shared_info[];
 #define _hypercall3(type, name, a1, a2, a3)			\
 ({								\
 	long __res, __ign1, __ign2, __ign3;			\
+	trace(TRACE_HYPERCALL, __HYPERVISOR_##name, (long)(a1));	\
 	asm volatile (						\
 		"call _minios_hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
 		: "=a" (__res), "=D" (__ign1), "=S" (__ign2), 	\
@@ -96,6 +101,7 @@ extern char _minios_shared_info[];
 #define _hypercall4(type, name, a1, a2, a3, a4)			\
 ({								\
 	long __res, __ign1, __ign2, __ign3;			\
+	trace(TRACE_HYPERCALL, __HYPERVISOR_##name, (long)(a1));	\
 	asm volatile (						\
 		"movq %7,%%r10; "				\
 		"call _minios_hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
@@ -110,6 +116,7 @@ extern char _minios_shared_info[];
 #define _hypercall5(type, name, a1, a2, a3, a4, a5)		\
 ({								\
 	long __res, __ign1, __ign2, __ign3;			\
+	trace(TRACE_HYPERCALL, __HYPERVISOR_##name, (long)(a1));	\
 	asm volatile (						\
 		"movq %7,%%r10; movq %8,%%r8; "			\
 		"call _minios_hypercall_page + ("STR(__HYPERVISOR_##name)" * 32)"\
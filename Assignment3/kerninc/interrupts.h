@@ -13,7 +13,6 @@ typedef unsigned long long u64;
 
 extern void *default_trap_ptr;
 extern void *pagefault_trap_ptr;
-extern void *rsp_base_addr;
 /*
  * NOTE: When declaring the IDT table, make
  * sure it is properly aligned, e.g.,
@@ -32,7 +31,7 @@ void init_idt_table(int num, void *ptr);
 void idt_pointer_init(void);
 void x86_initidt(void);
 void default_handler(void* rsp);
-void pagefault_handler(void);
+void pagefault_handler(u64 error);
 
 struct idt_descriptor {
 	u64 i_looffset:16;	/* gate offset (lsb) */
@@ -123,7 +122,7 @@ void init_tss_segment(void* addr)
  * for the TSS segment.
  */
 static inline
-void load_tss_segment(uint16_t selector, tss_segment_t *tss)
+void set_tss_descriptor(uint64_t *table, uint16_t selector, tss_segment_t *tss)
 {
 	uint64_t base = (uint64_t) tss;
 	uint16_t limit = sizeof(tss_segment_t) - 1;
@@ -132,11 +131,17 @@ void load_tss_segment(uint16_t selector, tss_segment_t *tss)
 	   https://www.amd.com/system/files/TechDocs/24593.pdf */
 
 	/* Initialize GDT's dummy entries */
-	uint64_t *tss_gdt = (uint64_t *) ((char *) gdt + selector);
+	uint64_t *tss_gdt = (uint64_t *) ((char *) table + selector);
 	/* Present=1, DPL=0, Type=9 (TSS), 16-bit limit, lower 32 bits of 'base' */
 	tss_gdt[0] = ((base & 0xFF000000ULL) << 32) | (1ULL << 47) | (0x9ULL << 40) | ((base & 0x00FFFFFFULL) << 16) | limit;
 	/* Upper 32 bits of 'base' */
 	tss_gdt[1] = base >> 32;
+}
+
+static inline
+void load_tss_segment(uint16_t selector, tss_segment_t *tss)
+{
+	set_tss_descriptor(gdt, selector, tss);
 
 	/* Load TSS, use the specified selector */
 	__asm__ __volatile__ ("ltr %0"
@@ -4,8 +4,7 @@
 extern "C" {
 #endif
 
-extern void *kernel_stack; /* the kernel stack, must be allocated */
-extern void *user_stack; /* the user stack, must be allocated */
+extern void *kernel_stack; /* the boot CPU's initial stack */
 void user_jump(void * addr); /* an initial jump to user mode, addr is a VIRTUAL address of user's _start */
 
 /*
@@ -20,8 +19,25 @@ extern void *syscall_entry_ptr;
 /* the system call handler */
 long do_syscall_entry(long n, long a1, long a2, long a3, long a4, long a5);
 
+typedef long (*syscall_fn_t)(long a1, long a2, long a3, long a4, long a5);
+
+/* install a handler in the dispatch table */
+void syscall_register(long n, syscall_fn_t fn);
+
+/*
+ * is [addr, addr+size) within the user portion of the address space,
+ * and mapped (or demand-paged) for user-mode reads?
+ * The stack, the image and the demand region are contiguous from
+ * USER_START to USER_FIXED_BASE; pages above that are checked by their PTEs
+ */
+int user_range_ok(long addr, unsigned long size);
+/* ... and also writable, so the kernel may store results there */
+int user_range_writable(long addr, unsigned long size);
+
 /* initialize system calls */
 void syscall_init(void);
+/* the per-CPU part of syscall_init(), for application processors */
+void syscall_init_cpu(void);
 
 #ifdef __cplusplus
 }
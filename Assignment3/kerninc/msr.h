@@ -6,6 +6,10 @@
 #define MSR_STAR	0xC0000081
 #define MSR_LSTAR	0xC0000082
 #define MSR_SFMASK	0xC0000084
+#define MSR_PAT		0x277
+#define MSR_FS_BASE	0xC0000100
+#define MSR_GS_BASE	0xC0000101
+#define MSR_KERNEL_GS_BASE	0xC0000102
 
 /* GDT entries, do not re-arrange those! */
 #define GDT_KERNEL_CODE	0x08
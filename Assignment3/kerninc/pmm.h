@@ -0,0 +1,39 @@
+#pragma once
+
+#include <types.h>
+#include <bootinfo.h>
+
+#define PAGE_SIZE		4096UL
+#define PAGE_SHIFT		12
+
+/* Blocks of up to 2^PMM_MAX_ORDER pages (4MB) */
+#define PMM_MAX_ORDER	10
+
+/* Only the 4GB identity-mapped by the kernel are managed */
+#define PMM_LIMIT		0x100000000ULL
+
+/*
+ * Boot-services memory (including the firmware's page tables) becomes
+ * free memory: call this only once the kernel's own CR3 is loaded
+ */
+void pmm_init(struct boot_info *bi);
+
+/* 2^order physically contiguous pages, NULL if out of memory */
+void *pmm_alloc_pages(unsigned int order);
+void pmm_free_pages(void *addr, unsigned int order);
+
+/* A single page, O(1) */
+void *pmm_alloc_page(void);
+void pmm_free_page(void *addr);
+void *pmm_alloc_zeroed_page(void);
+
+/* The smallest order that fits 'pages' pages */
+unsigned int pmm_order(size_t pages);
+
+size_t pmm_free_count(void);
+
+/*
+ * A page below 1MB (never handed out otherwise), for the AP startup
+ * trampoline; NULL if there is none or it was already taken
+ */
+void *pmm_alloc_low_page(void);
@@ -14,6 +14,13 @@ size_t sprintf(char * buffer, const char * fmt, ...);
 size_t vprintf(const char *fmt, va_list args);
 size_t printf(const char * fmt, ...);
 
+/* Serializes console output and the fb_fpu_save() area; not reentrant */
+unsigned long console_lock_irqsave(void);
+void console_unlock_irqrestore(unsigned long flags);
+
+/* With -DPRINTF_BENCHMARK, print the integer formatting rate */
+void printf_benchmark(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,71 @@
+#pragma once
+
+/*
+ * Per-CPU data and application processor startup (see smp.c)
+ *
+ * In the kernel, the GS base points to the running CPU's struct cpu;
+ * syscall_entry and the interrupt stubs use swapgs to get there from user
+ * mode. The offsets below are used by kernel_asm.S.
+ */
+
+#define SMP_MAX_CPUS		16
+
+#define CPU_SELF			0
+#define CPU_KERNEL_STACK	8
+#define CPU_USER_STACK		16
+
+#ifndef __ASSEMBLER__
+
+#include <types.h>
+#include <timer.h>
+#include <deque.h>
+
+struct task;
+struct trace_event;
+
+struct cpu {
+	struct cpu *self;
+	void *kernel_stack;		/* loaded by syscall_entry */
+	void *user_stack;		/* saved by syscall_entry */
+	struct task *current;
+	struct task *idle;
+	struct task *prev;		/* the task switched away from */
+	unsigned int id;
+	uint32_t apic_id;
+	unsigned int vcpu_id;	/* Xen vCPU: selects its pvclock record */
+	int need_resched;
+	unsigned int seed;		/* for picking steal victims */
+	struct timer slice_timer;
+	struct timer_heap timers;
+	void *tss;				/* tss_segment_t, see kernel.c */
+	void *boot_stack;
+	uint64_t gdt[8] __attribute__((aligned(16)));
+	struct deque runq;		/* runnable tasks, see task.c */
+	struct trace_event *trace;	/* TRACE_ENTRIES events, see trace.c */
+	uint64_t trace_head;		/* the next event number */
+};
+
+extern struct cpu *cpus[SMP_MAX_CPUS];
+extern volatile unsigned int smp_nr_cpus;
+
+static inline struct cpu *this_cpu(void)
+{
+	struct cpu *c;
+
+	__asm__ __volatile__("movq %%gs:0, %0" : "=r" (c));
+	return c;
+}
+
+/* The trampoline, see trampoline.S */
+extern void *trampoline_ptr;
+extern uint64_t trampoline_size, trampoline_data_offset;
+
+void smp_init_bsp(void);
+void smp_boot_aps(uint64_t rsdp);
+
+/* Per-CPU GDT, TSS, IDT and FS base of an application processor (kernel.c) */
+void ap_interrupt_and_tss_setup(struct cpu *c);
+/* Find this CPU's Xen vCPU id (kernel.c) */
+void pvclock_init_cpu(void);
+
+#endif
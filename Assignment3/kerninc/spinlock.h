@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Spinlocks (test-and-test-and-set); the _irqsave variants also keep
+ * interrupt handlers on the same CPU from deadlocking on the lock
+ */
+
+typedef struct {
+	volatile unsigned int locked;
+} spinlock_t;
+
+static inline void spin_lock(spinlock_t *l)
+{
+	while (__sync_lock_test_and_set(&l->locked, 1)) {
+		while (l->locked)
+			__asm__ __volatile__("pause");
+	}
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+	__sync_lock_release(&l->locked);
+}
+
+static inline unsigned long spin_lock_irqsave(spinlock_t *l)
+{
+	unsigned long flags;
+
+	__asm__ __volatile__("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	spin_lock(l);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, unsigned long flags)
+{
+	spin_unlock(l);
+	__asm__ __volatile__("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
+}
@@ -38,3 +38,7 @@ static inline size_t strlen(const char *str)
 		cur++;
 	return (size_t) (cur - str);
 }
+
+/* string.c */
+void *memset(void *dst, int ch, size_t n);
+void *memcpy(void *dst, const void *src, size_t n);
@@ -0,0 +1,15 @@
+#pragma once
+
+/* Batched system calls, see userinc/sysnr.h for the ring layout */
+
+#include <vm.h>
+
+/* Where the ring page is mapped in the user address space */
+#define SYSRING_ADDR	USER_FIXED_BASE
+
+struct task;
+
+/* registers SYS_ring_setup and SYS_ring_enter */
+void sysring_init(void);
+/* moves the SQPOLL timer along with the tasks, interrupts must be disabled */
+void sysring_switch(struct task *prev, struct task *next);
@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+ * Tasks and the round-robin scheduler (see task.c)
+ */
+
+#include <types.h>
+#include <vm.h>
+#include <timer.h>
+#include <smp.h>
+
+#define TASK_MAX			(16 + SMP_MAX_CPUS)	/* including the idle tasks */
+#define TASK_STACK_ORDER	1		/* task + kernel stack: 8KB */
+#define TASK_SLICE_NS		(10 * NSEC_PER_MSEC)
+
+struct task {
+	uint64_t ksp;			/* saved by switch_to(), keep it first */
+	uint8_t fpu[512] __attribute__((aligned(16)));	/* fxsave area */
+	void *kstack;			/* top of the kernel stack */
+	void *user_stack;		/* user %rsp while in a system call */
+	struct vm_space vm;
+	unsigned int pcid;
+	int pcid_used;			/* the PCID's TLB entries belong to this task */
+	int id;
+	int on_cpu;				/* running, or not yet saved by switch_to() */
+	struct sysring *ring;	/* kernel view of the task's ring, see sysring.c */
+	struct timer ring_poll;	/* SQPOLL: armed on the CPU running the task */
+	int ring_sqpoll;
+};
+
+/* The task running on this CPU; its idle task until sched_start() picks a user task */
+#define current_task		(this_cpu()->current)
+
+extern void *task_entry_ptr;	/* task_entry(), see kernel_entry.S */
+
+/* Context switch, see kernel_asm.S */
+void switch_to(uint64_t *prev_ksp, uint64_t next_ksp);
+
+/* Global scheduler state and the boot CPU */
+void sched_init(void);
+/* Per-CPU state of an application processor */
+void sched_init_cpu(void *boot_stack);
+void sched_finish_switch(void);
+struct task *task_alloc(void);
+void task_start_user(struct task *t, uint64_t entry, uint64_t rsp);
+void sched_add(struct task *t);
+void sched_start(void);
+void sched_preempt(void);
+
+/* Where interrupts from user mode switch the stack to (kernel.c) */
+void tss_set_rsp0(void *rsp0);
@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Tickless one-shot timers on the LAPIC (see timer.c)
+ */
+
+#include <types.h>
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+
+#define TIMER_VECTOR	40		/* the LAPIC timer interrupt */
+#define TIMER_MAX		64		/* armed timers per CPU */
+
+struct timer;
+typedef void (*timer_fn_t)(struct timer *t, void *data);
+
+/* Each CPU has its own heap of armed timers */
+struct timer_heap {
+	struct timer *heap[TIMER_MAX];
+	int size;
+};
+
+/*
+ * A timer fires on the CPU that armed it; only that CPU may re-arm or
+ * cancel it while it is armed
+ */
+struct timer {
+	uint64_t deadline;	/* TSC value */
+	timer_fn_t fn;
+	void *data;
+	int slot;			/* index in the heap, -1 if not armed */
+};
+
+/* tsc_hz = 0: use CPUID to find the TSC frequency */
+void timer_init(uint64_t tsc_hz);
+/* LAPIC timer setup of an application processor */
+void timer_init_cpu(void);
+void timer_setup(struct timer *t, timer_fn_t fn, void *data);
+int timer_arm(struct timer *t, uint64_t delay_ns);
+int timer_arm_at(struct timer *t, uint64_t deadline_tsc);
+void timer_cancel(struct timer *t);
+uint64_t timer_ns_to_tsc(uint64_t ns);
+uint64_t timer_tsc_to_ns(uint64_t tsc);
+/* 0 if timer_init() could not find the TSC frequency */
+uint64_t timer_tsc_hz(void);
+void timer_interrupt(void);
@@ -0,0 +1,42 @@
+#pragma once
+
+/*
+ * Per-CPU binary event tracing (see trace.c)
+ */
+
+#include <types.h>
+#include <rdtsc.h>
+#include <smp.h>
+#include "../userinc/sysnr.h"
+
+#define TRACE_SEQ_BUSY		0xFFFFFFFFU	/* the event is being written */
+
+/*
+ * Only the owning CPU writes its ring, so claiming a slot needs no lock
+ * prefix: an unlocked xadd is still atomic against interrupt handlers that
+ * trace on the same CPU. 'seq' is written last so that readers on other
+ * CPUs can tell complete events from torn ones.
+ */
+static inline void trace(unsigned int type, uint64_t a1, uint64_t a2)
+{
+	struct cpu *c = this_cpu();
+	struct trace_event *e;
+	uint64_t seq = 1;
+
+	if (!c->trace)
+		return;
+	__asm__ __volatile__ ("xaddq %0, %1" : "+r" (seq), "+m" (c->trace_head));
+	e = &c->trace[seq & (TRACE_ENTRIES - 1)];
+	e->seq = TRACE_SEQ_BUSY;
+	__asm__ __volatile__ ("" ::: "memory");
+	e->tsc = rdtsc();
+	e->type = type;
+	e->cpu = c->id;
+	e->a1 = a1;
+	e->a2 = a2;
+	__asm__ __volatile__ ("" ::: "memory");
+	e->seq = (uint32_t) seq;
+}
+
+struct trace_event *trace_ring_alloc(void);
+void trace_init(void);
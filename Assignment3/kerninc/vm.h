@@ -0,0 +1,114 @@
+#pragma once
+
+#include <types.h>
+
+/* Page table entry bits */
+#define PTE_P			0x001ULL	/* present */
+#define PTE_W			0x002ULL	/* writable */
+#define PTE_U			0x004ULL	/* user */
+#define PTE_PWT			0x008ULL	/* PAT index bit 0 */
+#define PTE_PCD			0x010ULL	/* PAT index bit 1 */
+#define PTE_PS			0x080ULL	/* 2MB/1GB page */
+#define PTE_PAT			0x080ULL	/* PAT index bit 2 of a 4KB page */
+#define PTE_G			0x100ULL	/* global, survives CR3 reloads */
+#define PTE_PAT_LARGE	0x1000ULL	/* PAT index bit 2 of a 2MB/1GB page */
+#define PTE_ADDR_MASK	0x000FFFFFFFFFF000ULL
+
+/* Write-combining: vm_init_tlb() turns PAT entry 1 (PWT only) into WC */
+#define PTE_WC			PTE_PWT
+
+/* Page-fault error code bits */
+#define PF_P			0x01U	/* protection violation (page was present) */
+#define PF_W			0x02U	/* write access */
+#define PF_U			0x04U	/* user-mode access */
+
+/* The user portion: the last GB of the address space */
+#define USER_BASE		0xFFFFFFFFC0000000ULL
+#define USER_STACK_SIZE	(64 * 4096ULL)
+/* The lowest user address: the bottom of the stack below the image */
+#define USER_START		(USER_BASE + 0x1000 - USER_STACK_SIZE)
+/* Pages the kernel maps for the task (SYSRING_ADDR, VCLOCK_ADDR), never demand-paged */
+#define USER_FIXED_BASE	0xFFFFFFFFFFF00000ULL
+
+#define VM_MAX_REGIONS	16
+
+/* Process-context identifiers of the kernel-only and user page tables */
+#define KERNEL_PCID		0
+#define USER_PCID		1
+
+#define CR3_NOFLUSH		(1ULL << 63)	/* keep TLB entries of the new PCID */
+
+#define CR4_PGE			(1ULL << 7)
+#define CR4_PCIDE		(1ULL << 17)
+#define CR4_OSXSAVE		(1ULL << 18)
+
+/* A range of virtual addresses backed by zeroed pages on demand */
+struct vm_region {
+	uint64_t start;		/* page-aligned */
+	uint64_t end;		/* page-aligned, exclusive (may wrap to 0) */
+	uint64_t flags;		/* PTE flags for new pages */
+};
+
+/* A process address space */
+struct vm_space {
+	uint64_t *pml4;
+	unsigned int nr_regions;
+	struct vm_region regions[VM_MAX_REGIONS];
+};
+
+static inline uint64_t read_cr2(void)
+{
+	uint64_t cr2;
+
+	__asm__ __volatile__ ("mov %%cr2, %0" : "=r" (cr2));
+	return cr2;
+}
+
+/* Flush the TLB entry of one page in the current address space */
+static inline void invlpg(uint64_t va)
+{
+	__asm__ __volatile__ ("invlpg (%0)" : : "r" (va) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+	uint64_t cr4;
+
+	__asm__ __volatile__ ("mov %%cr4, %0" : "=r" (cr4));
+	return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4)
+{
+	__asm__ __volatile__ ("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+extern int vm_has_pcid;
+
+/* Enable global pages and PCIDs when available, and the WC PAT entry */
+void vm_init_tlb(void);
+void vm_init_tlb_ap(void);
+
+/* Switch to 'pml4'; 'noflush' keeps the TLB entries cached for 'pcid' */
+void vm_load_cr3(uint64_t *pml4, unsigned int pcid, int noflush);
+
+/* Returns the PTE for 'va', allocating page tables if 'alloc' is set */
+uint64_t *vm_walk(uint64_t *pml4, uint64_t va, int alloc);
+int vm_map_page(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t flags);
+/*
+ * Set the cache type (PTE_PWT/PTE_PCD bits, e.g. PTE_WC) of the existing
+ * kernel mappings of [start, end), splitting large pages at the edges;
+ * flushes this CPU's caches and TLB, so call it before the APs start
+ */
+int vm_set_cache(uint64_t *pml4, uint64_t start, uint64_t end, uint64_t cache);
+
+int vm_add_region(struct vm_space *vs, uint64_t start, uint64_t end, uint64_t flags);
+
+/*
+ * Is every page of [start, start+size) mapped with 'flags' (e.g. PTE_U |
+ * PTE_W), now or after a demand fault? The caller checks for wrap-around
+ */
+int vm_user_access(struct vm_space *vs, uint64_t start, uint64_t size, uint64_t flags);
+
+/* Returns 0 if the fault was resolved, -1 otherwise */
+int vm_fault(struct vm_space *vs, uint64_t addr, unsigned int error);
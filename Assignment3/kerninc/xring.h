@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+ * xring - a request/response ring shared between two domains
+ *
+ * Modelled on Xen's io/ring.h: a single granted page holds a ring of
+ * XRING_SIZE slots shared by requests (produced by the front end) and
+ * responses (produced by the back end), plus the producer indices. Indices
+ * are free-running and only masked when accessing a slot.
+ *
+ * Notifications are suppressed with event indices: each side publishes the
+ * producer index at which it wants to be woken up (req_event/rsp_event)
+ * before going idle, and a producer only signals the event channel when
+ * its newly pushed batch crosses that index.
+ *
+ * Messages are read and written in place (see xring_req_slot() etc.); a
+ * response reuses the slot of an already consumed request, so the back end
+ * must be done with a request before writing the response to it.
+ */
+
+#include <types.h>
+#include <gnttab.h>
+#include <evtchn.h>
+
+#define XRING_SIZE		64		/* slots, power of two */
+#define XRING_MSG_DATA	40		/* inline payload bytes */
+
+struct xring_msg {
+	uint32_t id;
+	uint32_t len;
+	uint8_t data[XRING_MSG_DATA];
+};
+
+/* The shared page */
+struct xring_sring {
+	volatile uint32_t req_prod, req_event;
+	volatile uint32_t rsp_prod, rsp_event;
+	uint8_t pad[48];
+	struct xring_msg ring[XRING_SIZE];
+};
+
+/* Private state of one end */
+struct xring {
+	struct xring_sring *sring;
+	uint32_t req_prod_pvt, rsp_cons;	/* front end */
+	uint32_t rsp_prod_pvt, req_cons;	/* back end */
+	evtchn_port_t port;
+};
+
+/*
+ * How the front end hands the ring to the back end: written at
+ * XRING_BOOTSTRAP_OFFSET in a page the back end already has access to,
+ * magic last.
+ */
+#define XRING_BOOTSTRAP_OFFSET	0x100
+#define XRING_MAGIC				0x676e6972U		/* "ring" */
+
+struct xring_bootstrap {
+	uint32_t ring_ref;
+	uint32_t port;
+	volatile uint32_t magic;
+};
+
+int xring_front_init(struct xring *r, void *page, domid_t remote,
+		grant_ref_t *ref);
+int xring_back_init(struct xring *r, void *page, domid_t remote,
+		evtchn_port_t remote_port);
+
+/* Front end */
+struct xring_msg *xring_req_slot(struct xring *r);
+void xring_push_requests(struct xring *r);
+struct xring_msg *xring_get_response(struct xring *r);
+
+/* Back end */
+struct xring_msg *xring_get_request(struct xring *r);
+struct xring_msg *xring_rsp_slot(struct xring *r);
+void xring_push_responses(struct xring *r);
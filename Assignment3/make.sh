@@ -1,27 +1,57 @@
 #!/bin/sh
 
+# Uncomment to identity-map the kernel with 4KB pages rather than 2MB/1GB pages
+#PT_FLAGS=-DKERNEL_PT_4K
+
+# Uncomment to print the console's glyph rate (scalar vs. SIMD) at boot
+#FB_FLAGS=-DFB_BENCHMARK
+
+# Uncomment to print the integer formatting rate (old vs. digit-pair) at boot
+#PRINTF_FLAGS=-DPRINTF_BENCHMARK
+
+# Uncomment to store the kernel and user images LZ4-compressed (needs lz4);
+# the boot loader detects and expands them
+#LZ4=1
+
 # Compile the boot loader
-clang -m64 -O2 -fshort-wchar -I ../Include -I ../Include/X64 -mcmodel=small -mno-red-zone -mno-stack-arg-probe -target x86_64-pc-mingw32 -Wall -c boot.c
+clang -m64 -O2 -fshort-wchar -I ../Include -I ../Include/X64 -mcmodel=small -mno-red-zone -mno-stack-arg-probe -target x86_64-pc-mingw32 -Wall $PT_FLAGS -c boot.c
 lld-link /dll /nodefaultlib /safeseh:no /machine:AMD64 /entry:efi_main boot.o /out:boot.dll
 ../fwimage/fwimage app boot.dll boot.efi
 
 # Compile the kernel
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c kernel_entry.S
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c apic.c
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c kernel.c
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c kernel_asm.S
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c kernel_syscall.c
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c printf.c
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c fb.c
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c ascii_font.c
-gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c gnttab.c
-ld --oformat=binary -T ./kernel.lds -nostdlib -melf_x86_64 -pie kernel_entry.o apic.o kernel.o kernel_asm.o kernel_syscall.o printf.o fb.o ascii_font.o gnttab.o -o kernel
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c kernel_entry.S
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c apic.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie $PT_FLAGS -c kernel.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c kernel_asm.S
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c kernel_syscall.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie $PRINTF_FLAGS -c printf.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie $FB_FLAGS -c fb.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c ascii_font.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c gnttab.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c xring.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c evtchn.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c timer.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c task.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c pmm.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c string.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c vm.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c sysring.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c smp.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c trace.c
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -mgeneral-regs-only -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -c trampoline.S
+ld -s -n -T ./kernel.lds -nostdlib -melf_x86_64 -pie kernel_entry.o apic.o kernel.o kernel_asm.o kernel_syscall.o printf.o fb.o ascii_font.o gnttab.o xring.o evtchn.o timer.o task.o pmm.o string.o vm.o sysring.o smp.o trampoline.o trace.o -o kernel
 
 # Comple the user application
 gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./userinc -pie -fno-zero-initialized-in-bss -c user_entry.S
 gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./userinc -pie -fno-zero-initialized-in-bss -c user.c
 ld --oformat=binary -T ./user.lds -nostdlib -melf_x86_64 -pie user_entry.o user.o -o user
 
+# Compress the images, keeping the decompressed size in the frame header
+if [ -n "$LZ4" ]; then
+	lz4 -f -9 --content-size kernel kernel.lz4 && mv kernel.lz4 kernel
+	lz4 -f -9 --content-size user user.lz4 && mv user.lz4 user
+fi
+
 # Create a FAT image
 rm -rf ./uefi_fat_mnt
 mkdir ./uefi_fat_mnt
@@ -151,6 +151,68 @@ init_gnttab(void)
     printf("gnttab_table mapped at %p.\n", gnttab_table);
 }
 
+/*
+ * Batched grant mapping: callers fill arrays of map/unmap ops (see
+ * gnttab_set_map_op() and gnttab_set_unmap_op()), which are handed to Xen
+ * in a single hypercall; Xen reports the outcome of each entry in its
+ * status field.
+ */
+void
+gnttab_set_map_op(struct gnttab_map_grant_ref *op, uint64_t host_addr,
+        uint32_t flags, grant_ref_t ref, domid_t domid)
+{
+    op->host_addr = host_addr;
+    op->flags = flags;
+    op->ref = ref;
+    op->dom = domid;
+    op->status = GNTST_general_error;
+}
+
+void
+gnttab_set_unmap_op(struct gnttab_unmap_grant_ref *op, uint64_t host_addr,
+        grant_handle_t handle)
+{
+    op->host_addr = host_addr;
+    op->dev_bus_addr = 0;
+    op->handle = handle;
+    op->status = GNTST_general_error;
+}
+
+/*
+ * Returns 0 if every entry was mapped, the number of failed entries
+ * otherwise (check their status), or a negative error if the hypercall
+ * itself failed.
+ */
+int
+gnttab_map_batch(struct gnttab_map_grant_ref *ops, unsigned int count)
+{
+    unsigned int i;
+    int rc, failed = 0;
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, ops, count);
+    if (rc)
+        return rc;
+    for (i = 0; i < count; i++)
+        if (ops[i].status != GNTST_okay)
+            failed++;
+    return failed;
+}
+
+int
+gnttab_unmap_batch(struct gnttab_unmap_grant_ref *ops, unsigned int count)
+{
+    unsigned int i;
+    int rc, failed = 0;
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, ops, count);
+    if (rc)
+        return rc;
+    for (i = 0; i < count; i++)
+        if (ops[i].status != GNTST_okay)
+            failed++;
+    return failed;
+}
+
 void
 fini_gnttab(void)
 {
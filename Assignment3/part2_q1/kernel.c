@@ -15,6 +15,8 @@
 #include <memory.h>
 #include <rdtsc.h>
 #include <gnttab.h>
+#include <xring.h>
+#include <os.h>
 
 #define HYPERVISOR_XEN 0
 #define HYPERVISOR_NONE 4
@@ -615,16 +617,61 @@ void pvclock_init()
 	printf("wall clock:%ld\n", rtc_epochoffset + _x86_cpu_clock_monotonic_2);
 }
 
+/*
+
+Ring channel to the other domain (back end): answers each request with
+the square of its payload
+
+*/
+struct xring ring_chan;
+
+void ring_channel_init(void *shared_page, void *ring_addr)
+{
+	struct xring_bootstrap *boot = (struct xring_bootstrap *)(shared_page + XRING_BOOTSTRAP_OFFSET);
+	struct gnttab_map_grant_ref op;
+	struct xring_msg *req, *rsp;
+	int n = 0;
+
+	//Wait for the front end to publish the ring; it queues its requests first
+	while (boot->magic != XRING_MAGIC)
+	{
+		__asm__ __volatile__("pause");
+	}
+	rmb();
+
+	gnttab_set_map_op(&op, (uint64_t)ring_addr, GNTMAP_host_map, boot->ring_ref, (domid_t) 76);
+	if (gnttab_map_batch(&op, 1) != 0 ||
+		xring_back_init(&ring_chan, ring_addr, (domid_t) 76, boot->port) != 0)
+	{
+		printf("Cannot attach to the ring channel!\n");
+		return;
+	}
+
+	while ((req = xring_get_request(&ring_chan)) != NULL)
+	{
+		uint32_t id = req->id;
+		uint32_t val = *(uint32_t *)req->data;
+
+		//the response reuses the request's slot
+		rsp = xring_rsp_slot(&ring_chan);
+		rsp->id = id;
+		rsp->len = 4;
+		*(uint32_t *)rsp->data = val * val;
+		n++;
+	}
+	xring_push_responses(&ring_chan);
+	printf("Ring channel: answered %d requests\n", n);
+}
+
 void shared_memory_init(void *addr)
 {
 	struct gnttab_map_grant_ref op;
-	op.ref = 511;
-	op.dom = (domid_t) 76;
-	op.host_addr = (uint64_t)(addr+0x2000);
-	op.flags = GNTMAP_host_map;
-	
-	int rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-	if (rc != 0 || op.status != GNTST_okay)
+
+	//One entry here, but any number of grants map with a single hypercall
+	gnttab_set_map_op(&op, (uint64_t)(addr+0x2000), GNTMAP_host_map, GRANT_BOOTSTRAP_REF, (domid_t) 76);
+
+	int rc = gnttab_map_batch(&op, 1);
+	if (rc != 0)
 	{
 		printf("GNTTABOP_map_grant_ref failed: "
 			   "returned %d, status %d\n",
@@ -635,7 +682,8 @@ void shared_memory_init(void *addr)
 	}
 
 	printf("\nother side: %s\n", (char*)(addr+0x2000));
-	
+
+	ring_channel_init(addr+0x2000, addr+0x1000);
 }
 
 void kernel_start(void *addr, unsigned int *fb, int width, void *user_addr, void *user_buffer, int user_pages)
@@ -4,6 +4,7 @@
 
 #define rmb()   __asm__ __volatile__ ("lfence":::"memory")
 #define wmb()   __asm__ __volatile__ ("sfence" ::: "memory")
+#define mb()    __asm__ __volatile__ ("mfence" ::: "memory")
 
 struct __synch_xchg_dummy { unsigned long a[100]; };
 #define __synch_xg(x) ((volatile struct __synch_xchg_dummy *)(x))
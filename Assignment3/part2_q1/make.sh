@@ -15,7 +15,8 @@ gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601
 gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c fb.c
 gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c ascii_font.c
 gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c gnttab.c
-ld --oformat=binary -T ./kernel.lds -nostdlib -melf_x86_64 -pie kernel_entry.o apic.o kernel.o kernel_asm.o kernel_syscall.o printf.o fb.o ascii_font.o gnttab.o -o kernel
+gcc -Wall -Wno-builtin-declaration-mismatch -D__XEN_INTERFACE_VERSION__=0x040601 -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -I/usr/include/xen -pie -fno-zero-initialized-in-bss -c xring.c
+ld --oformat=binary -T ./kernel.lds -nostdlib -melf_x86_64 -pie kernel_entry.o apic.o kernel.o kernel_asm.o kernel_syscall.o printf.o fb.o ascii_font.o gnttab.o xring.o -o kernel
 
 # Comple the user application
 gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./userinc -pie -fno-zero-initialized-in-bss -c user_entry.S
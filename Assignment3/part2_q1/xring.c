@@ -0,0 +1,143 @@
+/*
+ * xring.c - a request/response ring shared between two domains
+ *
+ * See kerninc/xring.h.
+ */
+
+#include <xring.h>
+#include <os.h>
+#include <printf.h>
+
+#define XRING_IDX(i)	((i) & (XRING_SIZE - 1))
+
+_Static_assert(sizeof(struct xring_sring) <= 4096, "xring does not fit in a page");
+
+/*
+ * Set up the ring in page, grant it to domain remote and allocate the
+ * event channel; the ref and r->port are what the back end needs.
+ */
+int xring_front_init(struct xring *r, void *page, domid_t remote,
+		grant_ref_t *ref)
+{
+	struct xring_sring *s = page;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*s); i++)
+		((uint8_t *) s)[i] = 0;
+	s->req_event = 1;
+	s->rsp_event = 1;
+
+	r->sring = s;
+	r->req_prod_pvt = r->rsp_cons = 0;
+	r->rsp_prod_pvt = r->req_cons = 0;
+
+	*ref = gnttab_grant_access(remote, (unsigned long) page >> 12, 0);
+	if (*ref == GRANT_INVALID_REF)
+		return -1;
+	if (evtchn_alloc_unbound(remote, &r->port) != 0) {
+		gnttab_end_access(*ref);
+		return -1;
+	}
+	return 0;
+}
+
+/* Attach to a ring already mapped at page */
+int xring_back_init(struct xring *r, void *page, domid_t remote,
+		evtchn_port_t remote_port)
+{
+	r->sring = page;
+	r->req_prod_pvt = r->rsp_cons = 0;
+	r->rsp_prod_pvt = r->req_cons = 0;
+
+	return evtchn_bind_interdomain(remote, remote_port, &r->port);
+}
+
+/* Did the batch (old, new] cross the event index the other side set? */
+static inline int xring_need_notify(uint32_t old, uint32_t new, uint32_t event)
+{
+	return (uint32_t) (new - event) < (uint32_t) (new - old);
+}
+
+/* Next free request slot, or NULL if all slots await responses */
+struct xring_msg *xring_req_slot(struct xring *r)
+{
+	if (r->req_prod_pvt - r->rsp_cons >= XRING_SIZE)
+		return NULL;
+	return &r->sring->ring[XRING_IDX(r->req_prod_pvt++)];
+}
+
+void xring_push_requests(struct xring *r)
+{
+	uint32_t old = r->sring->req_prod;
+	uint32_t new = r->req_prod_pvt;
+
+	wmb(); /* messages before the index */
+	r->sring->req_prod = new;
+	mb(); /* index before reading req_event */
+	if (xring_need_notify(old, new, r->sring->req_event))
+		evtchn_notify(r->port);
+}
+
+/*
+ * Next response, or NULL once the ring is empty; in that case rsp_event is
+ * re-armed so that the back end signals the next response. The other side
+ * owns the producer index: one that claims more responses than there are
+ * outstanding requests is not trusted, and also yields NULL.
+ */
+struct xring_msg *xring_get_response(struct xring *r)
+{
+	uint32_t prod = r->sring->rsp_prod;
+
+	if (r->rsp_cons == prod) {
+		r->sring->rsp_event = r->rsp_cons + 1;
+		mb();
+		prod = r->sring->rsp_prod;
+		if (r->rsp_cons == prod)
+			return NULL;
+	}
+	if (prod - r->rsp_cons > r->req_prod_pvt - r->rsp_cons)
+		return NULL;
+	rmb(); /* index before the message */
+	return &r->sring->ring[XRING_IDX(r->rsp_cons++)];
+}
+
+/*
+ * Next request, or NULL once the ring is empty (re-arming req_event); also
+ * NULL if req_prod is more than a ring ahead, or if consuming another
+ * request would overwrite a slot still waiting for its response
+ */
+struct xring_msg *xring_get_request(struct xring *r)
+{
+	uint32_t prod = r->sring->req_prod;
+
+	if (r->req_cons == prod) {
+		r->sring->req_event = r->req_cons + 1;
+		mb();
+		prod = r->sring->req_prod;
+		if (r->req_cons == prod)
+			return NULL;
+	}
+	if (prod - r->req_cons > XRING_SIZE ||
+	    r->req_cons - r->rsp_prod_pvt >= XRING_SIZE)
+		return NULL;
+	rmb();
+	return &r->sring->ring[XRING_IDX(r->req_cons++)];
+}
+
+/* There is always a slot: each response answers a consumed request */
+struct xring_msg *xring_rsp_slot(struct xring *r)
+{
+	return &r->sring->ring[XRING_IDX(r->rsp_prod_pvt++)];
+}
+
+void xring_push_responses(struct xring *r)
+{
+	uint32_t old = r->sring->rsp_prod;
+	uint32_t new = r->rsp_prod_pvt;
+
+	wmb();
+	r->sring->rsp_prod = new;
+	mb();
+	if (xring_need_notify(old, new, r->sring->rsp_event))
+		evtchn_notify(r->port);
+}
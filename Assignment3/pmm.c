@@ -0,0 +1,260 @@
+/*
+ * pmm.c - a physical page allocator
+ *
+ * A binary buddy allocator seeded from the UEFI memory map. Free blocks
+ * are kept in per-order doubly-linked lists threaded through the free
+ * pages themselves (all managed memory is identity-mapped), and one byte
+ * per page frame records whether the frame heads a free block of a given
+ * order, which is all that is needed to coalesce buddies on free.
+ * A single spinlock serialises all CPUs.
+ */
+
+#include <pmm.h>
+#include <printf.h>
+#include <string.h>
+#include <spinlock.h>
+
+#define PMM_FREE		0x80U	/* frame heads a free block */
+
+/* Frames below 1MB are left alone (legacy BIOS/VGA areas) */
+#define PMM_LOW_FRAMES	256
+
+struct pmm_block {
+	struct pmm_block *next;
+	struct pmm_block *prev;
+};
+
+static struct pmm_block *free_list[PMM_MAX_ORDER + 1];
+static uint8_t *frame_info;
+static size_t max_frame, free_frames;
+static size_t low_frame;	/* a free frame below 1MB, 0 if none */
+static spinlock_t pmm_lock;
+
+static inline size_t addr_to_frame(void *addr)
+{
+	return (uintptr_t) addr >> PAGE_SHIFT;
+}
+
+static inline struct pmm_block *frame_to_block(size_t frame)
+{
+	return (struct pmm_block *) (frame << PAGE_SHIFT);
+}
+
+static void list_add(unsigned int order, size_t frame)
+{
+	struct pmm_block *b = frame_to_block(frame);
+
+	b->prev = NULL;
+	b->next = free_list[order];
+	if (b->next)
+		b->next->prev = b;
+	free_list[order] = b;
+	frame_info[frame] = PMM_FREE | order;
+}
+
+static void list_del(unsigned int order, size_t frame)
+{
+	struct pmm_block *b = frame_to_block(frame);
+
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		free_list[order] = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	frame_info[frame] = 0;
+}
+
+static void *alloc_pages(unsigned int order)
+{
+	unsigned int cur;
+	size_t frame;
+
+	/* Find the smallest block that fits */
+	for (cur = order; free_list[cur] == NULL; cur++) {
+		if (cur == PMM_MAX_ORDER)
+			return NULL;
+	}
+
+	frame = addr_to_frame(free_list[cur]);
+	list_del(cur, frame);
+
+	/* Split it, returning upper halves to the free lists */
+	while (cur != order) {
+		cur--;
+		list_add(cur, frame + (1UL << cur));
+	}
+
+	free_frames -= 1UL << order;
+	return frame_to_block(frame);
+}
+
+static void free_pages(void *addr, unsigned int order)
+{
+	size_t frame = addr_to_frame(addr);
+
+	free_frames += 1UL << order;
+
+	/* Coalesce with free buddies of the same order */
+	while (order < PMM_MAX_ORDER) {
+		size_t buddy = frame ^ (1UL << order);
+		if (buddy >= max_frame || frame_info[buddy] != (PMM_FREE | order))
+			break;
+		list_del(order, buddy);
+		frame &= ~(1UL << order);
+		order++;
+	}
+
+	list_add(order, frame);
+}
+
+void *pmm_alloc_pages(unsigned int order)
+{
+	unsigned long flags;
+	void *addr;
+
+	if (order > PMM_MAX_ORDER)
+		return NULL;
+
+	flags = spin_lock_irqsave(&pmm_lock);
+	addr = alloc_pages(order);
+	spin_unlock_irqrestore(&pmm_lock, flags);
+	return addr;
+}
+
+void pmm_free_pages(void *addr, unsigned int order)
+{
+	unsigned long flags = spin_lock_irqsave(&pmm_lock);
+
+	free_pages(addr, order);
+	spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void *pmm_alloc_page(void)
+{
+	return pmm_alloc_pages(0);
+}
+
+void pmm_free_page(void *addr)
+{
+	pmm_free_pages(addr, 0);
+}
+
+void *pmm_alloc_zeroed_page(void)
+{
+	void *page = pmm_alloc_pages(0);
+
+	if (page)
+		memset(page, 0, PAGE_SIZE);
+	return page;
+}
+
+unsigned int pmm_order(size_t pages)
+{
+	unsigned int order = 0;
+
+	while ((1UL << order) < pages)
+		order++;
+	return order;
+}
+
+size_t pmm_free_count(void)
+{
+	return free_frames;
+}
+
+void *pmm_alloc_low_page(void)
+{
+	size_t frame = low_frame;
+
+	low_frame = 0;
+	return frame ? frame_to_block(frame) : NULL;
+}
+
+/* Memory that is free once boot services are gone */
+static int pmm_usable(const struct efi_memory_descriptor *d)
+{
+	return d->type == EFI_CONVENTIONAL_MEMORY ||
+		d->type == EFI_BOOT_SERVICES_CODE ||
+		d->type == EFI_BOOT_SERVICES_DATA;
+}
+
+/* Add frames [start, end) as maximal naturally-aligned blocks */
+static void pmm_add_range(size_t start, size_t end)
+{
+	if (start < PMM_LOW_FRAMES)
+		start = PMM_LOW_FRAMES;
+	if (end > max_frame)
+		end = max_frame;
+
+	while (start < end) {
+		unsigned int order = 0;
+		while (order < PMM_MAX_ORDER &&
+				!(start & (1UL << order)) &&
+				start + (2UL << order) <= end)
+			order++;
+		free_pages(frame_to_block(start), order);
+		start += 1UL << order;
+	}
+}
+
+#define for_each_desc(d, bi) \
+	for (d = (struct efi_memory_descriptor *) (bi)->mmap; \
+		(uintptr_t) d < (bi)->mmap + (bi)->mmap_size; \
+		d = (struct efi_memory_descriptor *) ((uintptr_t) d + (bi)->mmap_desc_size))
+
+void pmm_init(struct boot_info *bi)
+{
+	struct efi_memory_descriptor *d;
+	size_t info_start = 0, info_end = 0, info_pages;
+
+	/* Find the highest usable frame */
+	max_frame = 0;
+	for_each_desc(d, bi) {
+		size_t end = (d->phys_start >> PAGE_SHIFT) + d->num_pages;
+		if (pmm_usable(d) && end > max_frame)
+			max_frame = end;
+	}
+	if (max_frame > (PMM_LIMIT >> PAGE_SHIFT))
+		max_frame = PMM_LIMIT >> PAGE_SHIFT;
+
+	/* Carve the frame_info array out of the first region that fits */
+	info_pages = (max_frame + PAGE_SIZE - 1) / PAGE_SIZE;
+	for_each_desc(d, bi) {
+		size_t start = d->phys_start >> PAGE_SHIFT;
+		size_t end = start + d->num_pages;
+		if (!pmm_usable(d) || start < PMM_LOW_FRAMES || end > max_frame)
+			continue;
+		if (d->num_pages >= info_pages) {
+			info_start = start;
+			info_end = start + info_pages;
+			break;
+		}
+	}
+	if (info_end == 0) {
+		printf("pmm: no room for %d frame descriptors!\n", (int) max_frame);
+		while (1) {} // halt the system
+	}
+	frame_info = (uint8_t *) frame_to_block(info_start);
+	memset(frame_info, 0, max_frame); /* everything is reserved for now */
+
+	/* Release all usable memory */
+	free_frames = 0;
+	low_frame = 0;
+	for_each_desc(d, bi) {
+		size_t start = d->phys_start >> PAGE_SHIFT;
+		size_t end = start + d->num_pages;
+		if (!pmm_usable(d))
+			continue;
+		if (start < PMM_LOW_FRAMES && end > 1 && low_frame == 0)
+			low_frame = start ? start : 1;
+		if (start < info_end && end > info_start) {
+			pmm_add_range(start, info_start);
+			pmm_add_range(info_end, end);
+		} else {
+			pmm_add_range(start, end);
+		}
+	}
+
+	printf("Physical memory: %d MB free\n", (int) (free_frames >> 8));
+}
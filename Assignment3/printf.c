@@ -117,6 +117,7 @@
 #include <printf.h>
 #include <string.h>
 #include <fb.h>
+#include <spinlock.h>
 
 /* display pointers in upper-case hex (A-F) instead of lower-case (a-f) */
 #define	PRINTF_UCP	1
@@ -140,22 +141,105 @@ const char HexDigits[32] = {
 	'a', 'b', 'c', 'd', 'e', 'f'
 };
 
-static char *write_uword_base10(char *where, size_t num)
+/* "00" through "99", two digits are produced per division */
+static const char DigitPairs[200] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const uint64_t Pow10[20] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+/* Number of significant bits, at least 1 */
+static inline unsigned int num_bits(uint64_t num)
+{
+	return 64 - __builtin_clzll(num | 1);
+}
+
+/* Number of decimal digits: log10 estimated from the bit count
+   (1233/4096 ~ log10(2)), then corrected by one table lookup;
+   powers of ten are even, so 'num | 1' only changes the answer for 0 */
+static inline unsigned int num_digits10(uint64_t num)
 {
+	unsigned int t = (num_bits(num) * 1233) >> 12;
+
+	return t + ((num | 1) >= Pow10[t]);
+}
+
+/* Writes the digits of num so that they end just before 'end' and returns
+   the count; the 64-bit part divides by constants (multiply and shift),
+   the rest is finished in cheaper 32-bit arithmetic */
+static size_t write_uword_base10(char *end, uint64_t num)
+{
+	size_t len = num_digits10(num);
+	char *where = end;
+	uint32_t low;
+
+	while (num > 0xFFFFFFFFULL) {
+		uint64_t q = num / 100;
+		where -= 2;
+		memcpy(where, &DigitPairs[(num - q * 100) * 2], 2);
+		num = q;
+	}
+	low = (uint32_t) num;
+	while (low >= 100) {
+		uint32_t q = low / 100;
+		where -= 2;
+		memcpy(where, &DigitPairs[(low - q * 100) * 2], 2);
+		low = q;
+	}
+	if (low >= 10) {
+		where -= 2;
+		memcpy(where, &DigitPairs[low * 2], 2);
+	} else {
+		*--where = low + '0';
+	}
+	return len;
+}
+
+/* Octal or hex, the digit count follows from the bit count */
+static size_t write_uword_pow2(char *end, uint64_t num, unsigned int shift,
+							   const char *digits)
+{
+	size_t len = (num_bits(num) + shift - 1) / shift;
+	unsigned int mask = (1U << shift) - 1;
+	char *where = end - len;
+
 	do {
-		size_t temp = num % 10;
-		*--where = temp + '0';
-		num = num / 10;
-	} while (num != 0);
-	return where;
+		*--end = digits[num & mask];
+		num >>= shift;
+	} while (end != where);
+	return len;
 }
 
-typedef void (*fnptr_t) (char, void *);
+/* An output sink, takes a span of characters at a time */
+typedef void (*fnptr_t) (const char *, size_t, void *);
+
+/* Emit 'num' copies of ch (' ' or '0') in as few spans as possible */
+static void pad_output(fnptr_t fn, void *ptr, char ch, size_t num)
+{
+	static const char spaces[16] = "                ";
+	static const char zeroes[16] = "0000000000000000";
+	const char *run = (ch == '0') ? zeroes : spaces;
+
+	while (num != 0) {
+		size_t n = num < sizeof(spaces) ? num : sizeof(spaces);
+		fn(run, n, ptr);
+		num -= n;
+	}
+}
 
 /*****************************************************************************
   name:	do_printf
   action:	minimal subfunction for ?printf, calls function
-	'fn' with arg 'ptr' for each character to be output
+	'fn' with arg 'ptr' for each span of characters to be output:
+	literal text between conversions, padding and converted values
   returns:total number of characters output
 *****************************************************************************/
 
@@ -163,7 +247,7 @@ static size_t _do_vprintf(const char *fmt, fnptr_t fn, void *ptr, va_list args)
 {
 	char *where, buf[PR_BUFLEN];
 	const char *digits;
-	size_t count, actual_wd, given_wd;
+	size_t count, actual_wd, given_wd, len;
 	unsigned int state, flags, shift;
 	size_t num;
 
@@ -175,11 +259,14 @@ but the indentation gets out of hand otherwise */
 	{
 /* STATE 0: AWAITING '%' */
 	case 0:
-/* echo text until '%' seen */
+/* echo text until '%' seen, as one span */
 		if (*fmt != '%')
 		{
-			fn(*fmt, ptr);
-			count++;
+			const char *run = fmt;
+			while (fmt[1] != '\0' && fmt[1] != '%')
+				fmt++;
+			fn(run, fmt + 1 - run, ptr);
+			count += fmt + 1 - run;
 			break;
 		}
 /* found %, get next char and advance state to check if next char is a flag */
@@ -191,7 +278,7 @@ but the indentation gets out of hand otherwise */
 	case 1:
 		if (*fmt == '%')	/* %% */
 		{
-			fn(*fmt, ptr);
+			fn(fmt, 1, ptr);
 			count++;
 			state = 0;
 			break;
@@ -272,6 +359,7 @@ but the indentation gets out of hand otherwise */
 			if (!num) {
 				flags &= ~PR_PADLEFT0;
 				where = "(nil)";
+				len = 5;
 				break;
 			}
 			flags |= PR_POINTER;
@@ -325,16 +413,11 @@ DO_NUM:
 DO_NUM_OUT:
 			/* Convert binary to octal/decimal/hex ASCII;
 			   the math here is _always_ unsigned */
-			if (!shift) {
-				where = write_uword_base10(where, num);
-			} else {
-				size_t mask = (1U << shift) - 1;
-				do {
-					size_t temp = num & mask;
-					*--where = digits[temp];
-					num = num >> shift;
-				} while (num != 0);
-			}
+			if (!shift)
+				len = write_uword_base10(where, num);
+			else
+				len = write_uword_pow2(where, num, shift, digits);
+			where -= len;
 			break;
 
 		case 'c':
@@ -343,6 +426,7 @@ DO_NUM_OUT:
 /* yes; we're converting a character to a string here: */
 			where--;
 			*where = (char) va_arg(args, int);
+			len = (*where != '\0');
 			break;
 		case 's':
 /* disallow these modifiers for %s */
@@ -350,16 +434,17 @@ DO_NUM_OUT:
 			where = va_arg(args, char *);
 			if (!where)
 				where = "(null)";
+			len = strlen(where);
 			break;
 /* bogus conversion character -- copy it to output and go back to state 0 */
 		default:
-			fn(*fmt, ptr);
+			fn(fmt, 1, ptr);
 			count++;
 			state = flags = given_wd = 0;
 			continue;
 		}
 /* emit formatted string */
-		actual_wd = strlen(where);
+		actual_wd = len;
 		if (flags & (PR_POINTER | PR_NEGATIVE))
 		{
 			actual_wd += 1 + ((flags & PR_POINTER) != 0);
@@ -367,53 +452,43 @@ DO_NUM_OUT:
 (for numeric values; not for %c or %s) */
 			if (flags & PR_PADLEFT0) {
 				if (flags & PR_POINTER) {
-					fn('0', ptr);
-					fn('x', ptr);
+					fn("0x", 2, ptr);
 					count += 2;
 				} else {
-					fn('-', ptr);
+					fn("-", 1, ptr);
 					count++;
 				}
 			}
 		}
 /* pad on left with spaces or zeroes (for right justify) */
-		if ((flags & PR_LEFTJUST) == 0)
+		if ((flags & PR_LEFTJUST) == 0 && given_wd > actual_wd)
 		{
-			for (; given_wd > actual_wd; given_wd--)
-			{
-				fn(flags & PR_PADLEFT0 ? '0' : ' ', ptr);
-				count++;
-			}
+			pad_output(fn, ptr, flags & PR_PADLEFT0 ? '0' : ' ', given_wd - actual_wd);
+			count += given_wd - actual_wd;
+			given_wd = actual_wd;
 		}
 /* if we pad left with SPACES, do the sign now */
 		if ((flags & (PR_POINTER | PR_NEGATIVE) &&
 					!(flags & PR_PADLEFT0)))
 		{
 			if (flags & PR_POINTER) {
-				fn('0', ptr);
-				fn('x', ptr);
+				fn("0x", 2, ptr);
 				count += 2;
 			} else {
-				fn('-', ptr);
+				fn("-", 1, ptr);
 				count++;
 			}
 		}
 /* emit converted number/char/string */
-		for (; *where != '\0'; where++)
-		{
-			fn(*where, ptr);
-			count++;
-		}
+		fn(where, len, ptr);
+		count += len;
 /* pad on right with spaces (for left justify) */
 		if (given_wd < actual_wd)
 			given_wd = 0;
 		else
 			given_wd -= actual_wd;
-		for (; given_wd; given_wd--)
-		{
-			fn(' ', ptr);
-			count++;
-		}
+		pad_output(fn, ptr, ' ', given_wd);
+		count += given_wd;
 		/* FALL THROUGH */
 	default:
 		state = flags = given_wd = 0;
@@ -426,7 +501,7 @@ static inline size_t do_vprintf(const char *fmt, fnptr_t fn, void *ptr,
 								va_list args)
 {
 	size_t count = _do_vprintf(fmt, fn, ptr, args);
-	fn('\0', ptr);
+	fn("", 1, ptr); /* the terminating NUL */
 	return count;
 }
 
@@ -439,19 +514,31 @@ typedef struct vsprintf_output_s {
 	char *Cur;
 } vsprintf_output_s;
 
-static void vsnprintf_output(char ch, void * _state)
+/* Copies what fits, the last byte of the buffer is always a NUL */
+static void vsnprintf_output(const char *str, size_t len, void * _state)
 {
 	vsnprintf_output_s * state = (vsnprintf_output_s *) _state;
 
-	if (state->Num != 0) {
-		*state->Cur++ = (--state->Num) ? ch : '\0';
+	if (state->Num == 0)
+		return;
+	if (len < state->Num) {
+		memcpy(state->Cur, str, len);
+		state->Cur += len;
+		state->Num -= len;
+	} else {
+		memcpy(state->Cur, str, state->Num - 1);
+		state->Cur[state->Num - 1] = '\0';
+		state->Cur += state->Num;
+		state->Num = 0;
 	}
 }
 
-static void vsprintf_output(char ch, void * _state)
+static void vsprintf_output(const char *str, size_t len, void * _state)
 {
 	vsprintf_output_s * state = (vsprintf_output_s *) _state;
-	*state->Cur++ = ch;
+
+	memcpy(state->Cur, str, len);
+	state->Cur += len;
 }
 
 size_t vsnprintf(char *buf, size_t n, const char *fmt, va_list args)
@@ -488,14 +575,73 @@ size_t sprintf(char *buf, const char *fmt, ...)
 	return rv;
 }
 
-static void vprintf_output(char ch, void * _state)
+/* Keeps the lines of different CPUs apart */
+static spinlock_t console_lock;
+
+/* For other users of the console's SIMD save area (fb_benchmark()) */
+unsigned long console_lock_irqsave(void)
+{
+	return spin_lock_irqsave(&console_lock);
+}
+
+void console_unlock_irqrestore(unsigned long flags)
 {
-	fb_output(ch);
+	spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/*
+ * The console sink collects each line and draws it with one fb_write();
+ * whatever is left is drawn at the end of every printf()
+ */
+#define CONSOLE_LINE	128
+
+static char console_line[CONSOLE_LINE];
+static size_t console_len;
+
+static void console_flush(void)
+{
+	if (console_len != 0) {
+		fb_write(console_line, console_len);
+		console_len = 0;
+	}
+}
+
+static void vprintf_output(const char *str, size_t len, void * _state)
+{
+	while (len != 0) {
+		size_t i, n = CONSOLE_LINE - console_len;
+		int eol = 0;
+
+		if (n > len)
+			n = len;
+		for (i = 0; i < n; i++) {
+			if (str[i] == '\n') {
+				n = i + 1;
+				eol = 1;
+				break;
+			}
+		}
+		memcpy(console_line + console_len, str, n);
+		console_len += n;
+		str += n;
+		len -= n;
+		if (eol || console_len == CONSOLE_LINE)
+			console_flush();
+	}
 }
 
 size_t vprintf(const char *fmt, va_list args)
 {
-	return do_vprintf(fmt, vprintf_output, NULL, args);
+	unsigned long flags = spin_lock_irqsave(&console_lock);
+	size_t rv;
+
+	fb_fpu_save();
+	rv = _do_vprintf(fmt, vprintf_output, NULL, args);
+	console_flush();
+	fb_flush();
+	fb_fpu_restore();
+	spin_unlock_irqrestore(&console_lock, flags);
+	return rv;
 }
 
 size_t printf(const char *fmt, ...)
@@ -508,3 +654,77 @@ size_t printf(const char *fmt, ...)
 	va_end(args);
 	return rv;
 }
+
+#ifdef PRINTF_BENCHMARK
+#include <rdtsc.h>
+#include <timer.h>
+
+#define PRINTF_BENCH_NUMS 100000
+
+/* The original formatter: one division and one remainder per digit */
+static size_t write_uword_base10_old(char *end, uint64_t num)
+{
+	char *where = end;
+
+	do {
+		*--where = num % 10 + '0';
+		num = num / 10;
+	} while (num != 0);
+	return end - where;
+}
+
+/* Spread the inputs over all lengths, clock values are mostly 10-20 digits */
+static uint64_t bench_value(unsigned int n)
+{
+	return (0x9E3779B97F4A7C15ULL * (n + 1)) >> (n % 64);
+}
+
+static uint64_t printf_bench_one(size_t (*fmt)(char *, uint64_t))
+{
+	char buf[PR_BUFLEN];
+	volatile size_t sink = 0;
+	uint64_t start = rdtsc();
+
+	for (unsigned int n = 0; n < PRINTF_BENCH_NUMS; n++)
+		sink += fmt(buf + sizeof(buf), bench_value(n));
+	(void) sink;
+	return timer_tsc_to_ns(rdtsc() - start);
+}
+
+/* Numbers per second of each formatter, and of a whole "%llu" snprintf */
+void printf_benchmark(void)
+{
+	uint64_t ns[3], start;
+	char buf[32];
+
+	for (unsigned int n = 0; n < PRINTF_BENCH_NUMS; n++) {
+		char a[PR_BUFLEN], b[PR_BUFLEN];
+		size_t la = write_uword_base10_old(a + sizeof(a), bench_value(n));
+		size_t lb = write_uword_base10(b + sizeof(b), bench_value(n));
+		size_t i = 0;
+
+		while (i < la && a[sizeof(a) - 1 - i] == b[sizeof(b) - 1 - i])
+			i++;
+		if (la != lb || i != la) {
+			printf("printf: formatter mismatch at %d\n", (int) n);
+			return;
+		}
+	}
+
+	ns[0] = printf_bench_one(write_uword_base10_old);
+	ns[1] = printf_bench_one(write_uword_base10);
+	start = rdtsc();
+	for (unsigned int n = 0; n < PRINTF_BENCH_NUMS; n++)
+		snprintf(buf, sizeof(buf), "%llu", bench_value(n));
+	ns[2] = timer_tsc_to_ns(rdtsc() - start);
+
+	printf("printf: numbers/s per-digit %d, digit-pair %d, snprintf %d\n",
+		(int) (ns[0] ? PRINTF_BENCH_NUMS * 1000000000ULL / ns[0] : 0),
+		(int) (ns[1] ? PRINTF_BENCH_NUMS * 1000000000ULL / ns[1] : 0),
+		(int) (ns[2] ? PRINTF_BENCH_NUMS * 1000000000ULL / ns[2] : 0));
+}
+#else
+void printf_benchmark(void)
+{
+}
+#endif
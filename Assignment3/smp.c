@@ -0,0 +1,280 @@
+/*
+ * smp.c - application processor startup
+ *
+ * Every CPU has a struct cpu that its GS base points to while in the kernel.
+ * The APs are started with the INIT-SIPI-SIPI sequence broadcast to all
+ * other CPUs: each one comes up through trampoline.S, sets up its own GDT,
+ * TSS, LAPIC and timer, and enters the scheduler. All CPUs share the kernel
+ * page tables and the IDT. Per-CPU memory is only allocated for the enabled
+ * CPUs listed in the ACPI MADT; without one, for up to SMP_MAX_CPUS.
+ */
+
+#include <smp.h>
+#include <msr.h>
+#include <apic.h>
+#include <pmm.h>
+#include <vm.h>
+#include <task.h>
+#include <kernel_syscall.h>
+#include <string.h>
+#include <printf.h>
+#include <rdtsc.h>
+#include <cpuid.h>
+#include <trace.h>
+
+/* The data block at trampoline_data_offset, see trampoline.S */
+struct trampoline_data {
+	uint64_t cr3;
+	uint64_t cr4;
+	uint64_t efer;
+	uint64_t entry;
+	void **stacks;
+	uint32_t max;
+	volatile uint32_t count;
+};
+
+#define AP_STACK_ORDER	1
+
+struct cpu *cpus[SMP_MAX_CPUS];
+volatile unsigned int smp_nr_cpus;
+
+void *trampoline_ptr; /* initialized in kernel_entry.S */
+
+static uint64_t bsp_xcr0; /* CR4 comes through the trampoline, XCR0 does not */
+
+/* ACPI tables are only read through the 4GB identity map */
+#define ACPI_MAPPED_LIMIT	0x100000000ULL
+
+struct acpi_rsdp {
+	char signature[8];		/* "RSD PTR " */
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;		/* 2+: the XSDT fields are valid */
+	uint32_t rsdt;
+	uint32_t length;
+	uint64_t xsdt;
+} __attribute__((packed));
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+#define MADT_LAPIC			0
+#define MADT_X2APIC			9
+#define MADT_ENABLED		0x1
+
+static int acpi_sig(const char *a, const char *b, unsigned int n)
+{
+	while (n--)
+		if (*a++ != *b++)
+			return 0;
+	return 1;
+}
+
+static struct acpi_header *acpi_table(uint64_t addr, const char *sig)
+{
+	struct acpi_header *h = (struct acpi_header *) addr;
+
+	if (addr == 0 || addr + sizeof(*h) > ACPI_MAPPED_LIMIT)
+		return NULL;
+	if (!acpi_sig(h->signature, sig, 4) || addr + h->length > ACPI_MAPPED_LIMIT)
+		return NULL;
+	return h;
+}
+
+/* The MADT, through the XSDT (64-bit entries) or else the RSDT */
+static struct acpi_header *acpi_find_madt(uint64_t rsdp_addr)
+{
+	struct acpi_rsdp *rsdp = (struct acpi_rsdp *) rsdp_addr;
+	struct acpi_header *sdt, *t;
+	unsigned int i, n, size;
+	uint64_t entry;
+
+	if (rsdp_addr == 0 || rsdp_addr + sizeof(*rsdp) > ACPI_MAPPED_LIMIT ||
+	    !acpi_sig(rsdp->signature, "RSD PTR ", 8))
+		return NULL;
+	if (rsdp->revision >= 2 && (sdt = acpi_table(rsdp->xsdt, "XSDT")) != NULL)
+		size = 8;
+	else if ((sdt = acpi_table(rsdp->rsdt, "RSDT")) != NULL)
+		size = 4;
+	else
+		return NULL;
+
+	n = (sdt->length - sizeof(*sdt)) / size;
+	for (i = 0; i < n; i++) {
+		entry = 0;
+		memcpy(&entry, (uint8_t *) (sdt + 1) + i * size, size);
+		if ((t = acpi_table(entry, "APIC")) != NULL)
+			return t;
+	}
+	return NULL;
+}
+
+/* Enabled CPUs in the MADT (including the boot CPU), 0 if unknown */
+static unsigned int acpi_count_cpus(uint64_t rsdp_addr)
+{
+	struct acpi_header *madt = acpi_find_madt(rsdp_addr);
+	uint8_t *p, *end;
+	uint32_t flags;
+	unsigned int n = 0;
+
+	if (!madt)
+		return 0;
+	/* Entries follow the local APIC address and flags */
+	p = (uint8_t *) (madt + 1) + 8;
+	end = (uint8_t *) madt + madt->length;
+	while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+		if (p[0] == MADT_LAPIC && p[1] >= 8) {
+			memcpy(&flags, p + 4, 4);
+			n += flags & MADT_ENABLED;
+		} else if (p[0] == MADT_X2APIC && p[1] >= 16) {
+			memcpy(&flags, p + 8, 4);
+			n += flags & MADT_ENABLED;
+		}
+		p += p[1];
+	}
+	return n;
+}
+
+static struct cpu *cpu_alloc(unsigned int id)
+{
+	struct cpu *c = pmm_alloc_zeroed_page();
+
+	if (!c)
+		return NULL;
+	c->self = c;
+	c->id = id;
+	c->trace = trace_ring_alloc();
+	cpus[id] = c;
+	return c;
+}
+
+static void cpu_set_gs(struct cpu *c)
+{
+	wrmsr(MSR_GS_BASE, (uint64_t) c);
+	wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+/* The boot CPU is CPU 0, right after pmm_init() */
+void smp_init_bsp(void)
+{
+	struct cpu *c = cpu_alloc(0);
+
+	if (!c) {
+		printf("smp: cannot allocate CPU 0!\n");
+		while (1) {} // halt the system
+	}
+	cpu_set_gs(c);
+	smp_nr_cpus = 1;
+}
+
+/* The first C code on an AP, on the stack smp_boot_aps() gave it */
+static void ap_main(unsigned int index)
+{
+	struct cpu *c = cpus[index + 1];
+
+	cpu_set_gs(c);
+	if (read_cr4() & CR4_OSXSAVE)
+		xsetbv(0, bsp_xcr0);
+	vm_init_tlb_ap();
+	ap_interrupt_and_tss_setup(c);
+	__asm__ __volatile__("cli" ::: "memory");
+	syscall_init_cpu();
+	x86_lapic_enable();
+	c->apic_id = apic_read_id();
+	timer_init_cpu();
+	pvclock_init_cpu();
+	sched_init_cpu(c->boot_stack);
+
+	__sync_fetch_and_add(&smp_nr_cpus, 1);
+	sched_start();
+}
+
+static void delay_ns(uint64_t ns)
+{
+	uint64_t start = rdtsc(), ticks = timer_ns_to_tsc(ns);
+
+	while (rdtsc() - start < ticks)
+		__asm__ __volatile__("pause");
+}
+
+static inline uint64_t read_cr3(void)
+{
+	uint64_t cr3;
+
+	__asm__ __volatile__("mov %%cr3, %0" : "=r" (cr3));
+	return cr3;
+}
+
+/*
+ * After timer_init() (for the delays) and before sched_start(); rsdp locates
+ * the MADT (0 if there is none)
+ */
+void smp_boot_aps(uint64_t rsdp)
+{
+	static void *stacks[SMP_MAX_CPUS - 1];
+	uint8_t *page;
+	struct trampoline_data *data;
+	unsigned int i, n, online, aps, listed;
+
+	cpus[0]->apic_id = apic_read_id();
+	listed = acpi_count_cpus(rsdp);
+	aps = listed ? listed - 1 : SMP_MAX_CPUS - 1;
+	if (aps > SMP_MAX_CPUS - 1)
+		aps = SMP_MAX_CPUS - 1;
+	if (aps == 0) {
+		printf("smp: the MADT lists no other CPUs\n");
+		return;
+	}
+	page = pmm_alloc_low_page();
+	if (!page) {
+		printf("smp: no memory below 1MB for the trampoline\n");
+		return;
+	}
+
+	/* APs beyond data->max halt in the trampoline */
+	for (n = 0; n < aps; n++) {
+		struct cpu *c = cpu_alloc(n + 1);
+		uint8_t *stack = pmm_alloc_pages(AP_STACK_ORDER);
+		if (!c || !stack)
+			break;
+		c->boot_stack = stack + (PAGE_SIZE << AP_STACK_ORDER);
+		stacks[n] = c->boot_stack;
+	}
+
+	memcpy(page, trampoline_ptr, trampoline_size);
+	data = (struct trampoline_data *) (page + trampoline_data_offset);
+	data->cr3 = read_cr3() & PTE_ADDR_MASK;
+	data->cr4 = read_cr4() & ~CR4_PCIDE; /* vm_init_tlb_ap() sets it */
+	data->efer = rdmsr(MSR_EFER);
+	if (data->cr4 & CR4_OSXSAVE)
+		bsp_xcr0 = xgetbv(0);
+	data->entry = (uint64_t) ap_main;
+	data->stacks = stacks;
+	data->max = n;
+	data->count = 0;
+
+	/* INIT, then STARTUP twice (Intel SDM 8.4.4.1) */
+	apic_broadcast_init();
+	delay_ns(10 * NSEC_PER_MSEC);
+	for (i = 0; i < 2; i++) {
+		apic_broadcast_startup((uint64_t) page >> PAGE_SHIFT);
+		delay_ns(200 * NSEC_PER_USEC);
+	}
+
+	/* Wait for the ones that came up to finish their setup */
+	delay_ns(100 * NSEC_PER_MSEC);
+	online = data->count < n ? data->count : n;
+	for (i = 0; i < 1000 && smp_nr_cpus < online + 1; i++)
+		delay_ns(NSEC_PER_MSEC);
+
+	printf("smp: %d CPUs online\n", (int) smp_nr_cpus);
+}
@@ -0,0 +1,32 @@
+/*
+ * string.c - memory routines for the kernel
+ *
+ * These are also needed by the compiler itself which may turn
+ * simple loops into memset()/memcpy() calls.
+ */
+
+#include <string.h>
+
+void *memset(void *dst, int ch, size_t n)
+{
+	void *ret = dst;
+
+	__asm__ __volatile__ ("rep stosb"
+		: "+D" (dst), "+c" (n)
+		: "a" (ch)
+		: "memory"
+	);
+	return ret;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+
+	__asm__ __volatile__ ("rep movsb"
+		: "+D" (dst), "+S" (src), "+c" (n)
+		:
+		: "memory"
+	);
+	return ret;
+}
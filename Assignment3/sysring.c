@@ -0,0 +1,135 @@
+/*
+ * sysring.c - batched system calls through a shared submission ring
+ *
+ * The user program queues system calls in a page that is mapped both in the
+ * user address space (SYSRING_ADDR) and in the kernel's identity map, then
+ * enters the kernel once with SYS_ring_enter for the whole batch. Each task
+ * has at most one ring. With SYSRING_SETUP_SQPOLL, a kernel timer drains the
+ * ring every SYSRING_POLL_NS and the user program does not need to enter the
+ * kernel at all: the timer is armed on whichever CPU runs the task and is
+ * cancelled when the task is switched out (sysring_switch()), since the
+ * entries point into the task's address space. The poller runs in interrupt
+ * context, so it fails the system calls that could switch tasks.
+ */
+
+#include <types.h>
+#include <sysring.h>
+#include <kernel_syscall.h>
+#include <pmm.h>
+#include <vm.h>
+#include <timer.h>
+#include <task.h>
+#include "userinc/sysnr.h"
+
+#define barrier()	__asm__ __volatile__ ("" ::: "memory")
+
+_Static_assert(sizeof(struct sysring) <= PAGE_SIZE, "the ring must fit in a page");
+
+#define SYSRING_POLL_NS	(1 * NSEC_PER_MSEC)
+
+/* Would system call n switch tasks? */
+static int sysring_may_block(long n)
+{
+	return n == SYS_yield;
+}
+
+/* Consume submissions while there is room for their completions */
+static long sysring_drain(struct sysring *ring, int from_poller)
+{
+	uint32_t head = ring->sq_head, tail = ring->sq_tail;
+	uint32_t cq_tail = ring->cq_tail;
+	long done = 0;
+
+	barrier(); /* read the entries after sq_tail */
+	while (head != tail && cq_tail - ring->cq_head != SYSRING_ENTRIES) {
+		struct sysring_sqe *sqe = &ring->sq[head % SYSRING_ENTRIES];
+		struct sysring_cqe *cqe = &ring->cq[cq_tail % SYSRING_ENTRIES];
+		long n = sqe->n;
+
+		if (n == SYS_ring_setup || n == SYS_ring_enter ||
+		    (from_poller && sysring_may_block(n)))
+			cqe->res = SYSCALL_EINVAL;
+		else
+			cqe->res = do_syscall_entry(n, sqe->args[0], sqe->args[1],
+				sqe->args[2], sqe->args[3], sqe->args[4]);
+		cqe->user_data = sqe->user_data;
+		head++;
+		cq_tail++;
+		done++;
+	}
+
+	barrier(); /* publish the completions before the indices */
+	ring->sq_head = head;
+	ring->cq_tail = cq_tail;
+	return done;
+}
+
+/* Start polling for the task on this CPU, interrupts must be disabled */
+static void sysring_arm(struct task *t)
+{
+	if (timer_arm(&t->ring_poll, SYSRING_POLL_NS) != 0)
+		t->ring->flags |= SYSRING_NEED_WAKEUP;
+	else
+		t->ring->flags &= ~SYSRING_NEED_WAKEUP;
+}
+
+static void sysring_poll(struct timer *t, void *data)
+{
+	struct task *owner = data;
+
+	/* Cancelled when the owner is switched out, so it is running here */
+	if (current_task != owner)
+		return;
+	sysring_drain(owner->ring, 1);
+	sysring_arm(owner);
+}
+
+void sysring_switch(struct task *prev, struct task *next)
+{
+	if (prev->ring_sqpoll)
+		timer_cancel(&prev->ring_poll);
+	if (next->ring_sqpoll)
+		sysring_arm(next);
+}
+
+static long sys_ring_setup(long a1, long a2, long a3, long a4, long a5)
+{
+	struct task *t = current_task;
+	void *page;
+
+	if (t->ring)
+		return SYSCALL_EBUSY;
+	page = pmm_alloc_zeroed_page();
+	if (!page)
+		return SYSCALL_ENOMEM;
+	if (vm_map_page(t->vm.pml4, SYSRING_ADDR, (uint64_t) page, PTE_W | PTE_U) != 0) {
+		pmm_free_page(page);
+		return SYSCALL_ENOMEM;
+	}
+	invlpg(SYSRING_ADDR);
+
+	t->ring = page;
+	if (a1 & SYSRING_SETUP_SQPOLL) {
+		timer_setup(&t->ring_poll, sysring_poll, t);
+		t->ring_sqpoll = 1;
+		sysring_arm(t);
+	} else {
+		t->ring->flags = SYSRING_NEED_WAKEUP;
+	}
+	return (long) SYSRING_ADDR;
+}
+
+static long sys_ring_enter(long a1, long a2, long a3, long a4, long a5)
+{
+	struct task *t = current_task;
+
+	if (!t->ring)
+		return SYSCALL_EINVAL;
+	return sysring_drain(t->ring, 0);
+}
+
+void sysring_init(void)
+{
+	syscall_register(SYS_ring_setup, sys_ring_setup);
+	syscall_register(SYS_ring_enter, sys_ring_enter);
+}
@@ -0,0 +1,284 @@
+/*
+ * task.c - tasks and a preemptive round-robin scheduler
+ *
+ * Each task owns a user address space (with its own PCID), a TLS page, an
+ * FPU state and a kernel stack; the task structure sits at the bottom of
+ * its kernel stack. The running task gets TASK_SLICE_NS before the LAPIC
+ * timer preempts it; with nothing to run, a CPU switches to its idle task
+ * (the context it booted on) and halts without a timer armed.
+ *
+ * Every CPU queues runnable tasks in its own lock-free deque (deque.h). It
+ * pushes at the bottom and takes the oldest task from the top, so each CPU
+ * runs its tasks round-robin; a CPU that runs out of work steals from the
+ * top of a randomly chosen victim's deque. Halted CPUs are woken with an IPI
+ * when work is queued. A task that is put back on a queue keeps on_cpu set
+ * until switch_to() has saved it, so a CPU that steals it in the meantime
+ * waits before resuming it.
+ */
+
+#include <task.h>
+#include <kernel_syscall.h>
+#include <pmm.h>
+#include <string.h>
+#include <printf.h>
+#include <apic.h>
+#include <trace.h>
+#include <sysring.h>
+#include "userinc/sysnr.h"
+
+void *task_entry_ptr;
+
+static int nr_tasks;
+static volatile uint64_t idle_cpus; /* halted in sched_start(), by CPU id */
+
+_Static_assert(TASK_MAX <= DEQUE_SIZE, "a run queue must hold every task");
+
+/*
+ * Wake one halted CPU to steal the work that was just queued; it takes
+ * itself off idle_cpus when it wakes up, a CPU is only kicked once
+ */
+static void kick_idle_cpu(void)
+{
+	uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_RELAXED);
+	unsigned int id;
+
+	while (idle != 0) {
+		id = __builtin_ctzll(idle);
+		if (__atomic_compare_exchange_n(&idle_cpus, &idle, idle & ~(1ULL << id),
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			apic_send_ipi(cpus[id]->apic_id, APIC_IPI_VECTOR);
+			return;
+		}
+	}
+}
+
+/* Queue on this CPU (owner side of its deque), interrupts must be disabled */
+static void runq_push(struct task *t)
+{
+	deque_push(&this_cpu()->runq, t);
+	/* Order the push before the idle_cpus check (see sched_start()) */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (idle_cpus != 0)
+		kick_idle_cpu();
+}
+
+static inline unsigned int cpu_random(struct cpu *c)
+{
+	/* xorshift32 */
+	c->seed ^= c->seed << 13;
+	c->seed ^= c->seed >> 17;
+	c->seed ^= c->seed << 5;
+	return c->seed;
+}
+
+/*
+ * The oldest task of this CPU's queue (round-robin), or else one stolen
+ * from the top of another CPU's queue, starting at a random victim
+ */
+static struct task *runq_pop(struct cpu *c)
+{
+	struct task *t;
+	unsigned int i, start;
+
+	while (!deque_empty(&c->runq)) {
+		t = deque_steal(&c->runq);
+		if (t)
+			return t;
+	}
+
+	start = cpu_random(c);
+	for (i = 0; i < SMP_MAX_CPUS; i++) {
+		struct cpu *victim = cpus[(start + i) % SMP_MAX_CPUS];
+		if (!victim || victim == c)
+			continue;
+		while (!deque_empty(&victim->runq)) {
+			t = deque_steal(&victim->runq);
+			if (t)
+				return t;
+		}
+	}
+	return NULL;
+}
+
+static int runq_any(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SMP_MAX_CPUS; i++) {
+		if (cpus[i] && !deque_empty(&cpus[i]->runq))
+			return 1;
+	}
+	return 0;
+}
+
+/* Runs on the CPU that switched, in the context of the task it resumed */
+void sched_finish_switch(void)
+{
+	struct cpu *c = this_cpu();
+
+	__atomic_store_n(&c->prev->on_cpu, 0, __ATOMIC_RELEASE);
+	c->user_stack = c->current->user_stack;
+}
+
+/* Switch to the next runnable task, interrupts must be disabled */
+static void schedule(void)
+{
+	struct cpu *c = this_cpu();
+	struct task *prev = c->current, *next;
+
+	c->need_resched = 0;
+	if (prev != c->idle)
+		runq_push(prev);
+	next = runq_pop(c);
+	if (!next)
+		next = c->idle;
+
+	if (next != c->idle)
+		timer_arm(&c->slice_timer, TASK_SLICE_NS);
+	else
+		timer_cancel(&c->slice_timer);
+	if (next == prev)
+		return;
+
+	/* Still being switched away from on another CPU? */
+	while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+		__asm__ __volatile__("pause");
+	next->on_cpu = 1;
+	sysring_switch(prev, next);
+
+	/* The idle task keeps whatever user address space was loaded */
+	if (next != c->idle) {
+		c->kernel_stack = next->kstack;
+		tss_set_rsp0(next->kstack);
+		vm_load_cr3(next->vm.pml4, next->pcid, next->pcid_used);
+		next->pcid_used = 1;
+	}
+
+	__asm__ __volatile__("fxsave64 %0" : "=m" (prev->fpu));
+	__asm__ __volatile__("fxrstor64 %0" : : "m" (next->fpu));
+	prev->user_stack = c->user_stack;
+	c->current = next;
+	c->prev = prev;
+	trace(TRACE_SWITCH, prev->id, next->id);
+
+	switch_to(&prev->ksp, next->ksp);
+
+	/* Back in prev, possibly on another CPU */
+	sched_finish_switch();
+}
+
+static void slice_expired(struct timer *t, void *data)
+{
+	this_cpu()->need_resched = 1;
+}
+
+/* Called on the way out of the timer interrupt */
+void sched_preempt(void)
+{
+	struct cpu *c = this_cpu();
+
+	if (c->need_resched && c->current)
+		schedule();
+}
+
+static long sys_yield(long a1, long a2, long a3, long a4, long a5)
+{
+	schedule();
+	return 0;
+}
+
+static long sys_task_id(long a1, long a2, long a3, long a4, long a5)
+{
+	return current_task->id;
+}
+
+struct task *task_alloc(void)
+{
+	struct task *t;
+	int id = __sync_fetch_and_add(&nr_tasks, 1);
+
+	if (id >= TASK_MAX)
+		return NULL;
+	t = pmm_alloc_pages(TASK_STACK_ORDER);
+	if (!t)
+		return NULL;
+
+	memset(t, 0, sizeof(*t));
+	t->id = id;
+	t->pcid = USER_PCID + t->id;
+	t->kstack = (uint8_t *) t + (PAGE_SIZE << TASK_STACK_ORDER);
+	__asm__ __volatile__("fxsave64 %0" : "=m" (t->fpu));
+	return t;
+}
+
+/*
+ * Lay out the kernel stack as switch_to() leaves it, returning into
+ * task_entry() which drops to user mode at entry/rsp (%r12/%r13)
+ */
+void task_start_user(struct task *t, uint64_t entry, uint64_t rsp)
+{
+	uint64_t *sp = t->kstack;
+
+	*--sp = (uint64_t) task_entry_ptr;
+	*--sp = 0;		/* %rbp */
+	*--sp = 0;		/* %rbx */
+	*--sp = entry;	/* %r12 */
+	*--sp = rsp;	/* %r13 */
+	*--sp = 0;		/* %r14 */
+	*--sp = 0;		/* %r15 */
+	t->ksp = (uint64_t) sp;
+}
+
+void sched_add(struct task *t)
+{
+	unsigned long flags;
+
+	__asm__ __volatile__("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	runq_push(t);
+	__asm__ __volatile__("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
+}
+
+/* The context this CPU booted on (stack top: boot_stack) becomes its idle task */
+void sched_init_cpu(void *boot_stack)
+{
+	struct cpu *c = this_cpu();
+
+	c->idle = task_alloc();
+	if (!c->idle) {
+		printf("sched: cannot allocate the idle task!\n");
+		while (1) {} // halt the system
+	}
+	c->idle->kstack = boot_stack;
+	c->idle->on_cpu = 1;
+	c->current = c->idle;
+	c->seed = 2463534242U + c->id;
+	timer_setup(&c->slice_timer, slice_expired, NULL);
+}
+
+void sched_init(void)
+{
+	sched_init_cpu(kernel_stack);
+	syscall_register(SYS_yield, sys_yield);
+	syscall_register(SYS_task_id, sys_task_id);
+}
+
+/* Never returns: runs the queued tasks and idles when there are none */
+void sched_start(void)
+{
+	__asm__ __volatile__("cli" ::: "memory");
+	if (this_cpu()->id == 0)
+		printf("sched: starting %d tasks on %d CPUs\n",
+			nr_tasks - (int) smp_nr_cpus, (int) smp_nr_cpus);
+	schedule();
+
+	/* Back in the idle task: nothing to run or steal */
+	while (1) {
+		uint64_t bit = 1ULL << this_cpu()->id;
+
+		__atomic_fetch_or(&idle_cpus, bit, __ATOMIC_SEQ_CST);
+		if (!runq_any())
+			__asm__ __volatile__("sti; hlt; cli" ::: "memory");
+		__atomic_fetch_and(&idle_cpus, ~bit, __ATOMIC_SEQ_CST);
+		schedule();
+	}
+}
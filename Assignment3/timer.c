@@ -0,0 +1,283 @@
+/*
+ * timer.c - tickless timers
+ *
+ * Armed timers are kept in a binary min-heap ordered by their TSC
+ * deadline, and the LAPIC timer is always programmed in one-shot mode for
+ * the earliest one only, so an idle CPU takes no periodic interrupts. With
+ * TSC-deadline mode the LAPIC fires at the exact TSC value; otherwise the
+ * one-shot count is derived from a LAPIC/TSC ratio calibrated at boot.
+ *
+ * Every CPU has its own heap (in struct cpu) and only ever touches it with
+ * interrupts disabled, so no locking is needed.
+ */
+
+#include <timer.h>
+#include <apic.h>
+#include <cpuid.h>
+#include <rdtsc.h>
+#include <printf.h>
+#include <smp.h>
+
+
+/* Fixed-point factors: x * mult >> TIMER_SHIFT */
+#define TIMER_SHIFT		28
+
+static uint64_t tsc_hz;
+static uint64_t ns_to_tsc_mult, tsc_to_ns_mult, tsc_to_lapic_mult;
+static int tsc_deadline;
+
+static inline uint64_t
+mul_shift(uint64_t a, uint64_t mult)
+{
+	return (uint64_t) (((unsigned __int128) a * mult) >> TIMER_SHIFT);
+}
+
+uint64_t
+timer_ns_to_tsc(uint64_t ns)
+{
+	return mul_shift(ns, ns_to_tsc_mult);
+}
+
+uint64_t
+timer_tsc_to_ns(uint64_t tsc)
+{
+	return mul_shift(tsc, tsc_to_ns_mult);
+}
+
+uint64_t
+timer_tsc_hz(void)
+{
+	return tsc_hz;
+}
+
+static inline unsigned long
+irq_save(void)
+{
+	unsigned long flags;
+
+	__asm__ __volatile__("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	return flags;
+}
+
+static inline void
+irq_restore(unsigned long flags)
+{
+	__asm__ __volatile__("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
+}
+
+/* Min-heap on deadline; timers know their slot for O(log n) removal */
+
+static inline void
+heap_set(struct timer_heap *h, int i, struct timer *t)
+{
+	h->heap[i] = t;
+	t->slot = i;
+}
+
+static void
+heap_up(struct timer_heap *h, int i)
+{
+	struct timer *t = h->heap[i];
+
+	while (i > 0 && h->heap[(i - 1) / 2]->deadline > t->deadline) {
+		heap_set(h, i, h->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(h, i, t);
+}
+
+static void
+heap_down(struct timer_heap *h, int i)
+{
+	struct timer *t = h->heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < h->size) {
+		if (child + 1 < h->size &&
+				h->heap[child + 1]->deadline < h->heap[child]->deadline)
+			child++;
+		if (h->heap[child]->deadline >= t->deadline)
+			break;
+		heap_set(h, i, h->heap[child]);
+		i = child;
+	}
+	heap_set(h, i, t);
+}
+
+static void
+heap_remove(struct timer_heap *h, struct timer *t)
+{
+	int i = t->slot;
+
+	t->slot = -1;
+	if (--h->size == i)
+		return;
+	heap_set(h, i, h->heap[h->size]);
+	heap_up(h, i);
+	heap_down(h, h->heap[i]->slot);
+}
+
+/* Program this CPU's LAPIC for the earliest deadline, or stop it */
+static void
+timer_program(struct timer_heap *h)
+{
+	uint64_t next, now, count;
+
+	if (h->size == 0) {
+		if (tsc_deadline)
+			apic_timer_deadline(0);
+		else
+			apic_timer_oneshot(0);
+		return;
+	}
+
+	next = h->heap[0]->deadline;
+	if (tsc_deadline) {
+		apic_timer_deadline(next);
+		return;
+	}
+
+	/* Too far out for the 32-bit counter: fire early and re-program */
+	now = rdtsc();
+	count = next > now ? mul_shift(next - now, tsc_to_lapic_mult) : 0;
+	if (count == 0)
+		count = 1;
+	if (count > 0xFFFFFFFFULL)
+		count = 0xFFFFFFFFULL;
+	apic_timer_oneshot((uint32_t) count);
+}
+
+void
+timer_setup(struct timer *t, timer_fn_t fn, void *data)
+{
+	t->fn = fn;
+	t->data = data;
+	t->slot = -1;
+}
+
+/* Re-arming an armed timer moves it; returns -1 if the heap is full */
+int
+timer_arm_at(struct timer *t, uint64_t deadline_tsc)
+{
+	unsigned long flags = irq_save();
+	struct timer_heap *h = &this_cpu()->timers;
+
+	if (t->slot >= 0) {
+		heap_remove(h, t);
+	} else if (h->size == TIMER_MAX) {
+		irq_restore(flags);
+		return -1;
+	}
+
+	t->deadline = deadline_tsc;
+	heap_set(h, h->size, t);
+	heap_up(h, h->size++);
+	if (h->heap[0] == t)
+		timer_program(h);
+
+	irq_restore(flags);
+	return 0;
+}
+
+int
+timer_arm(struct timer *t, uint64_t delay_ns)
+{
+	return timer_arm_at(t, rdtsc() + timer_ns_to_tsc(delay_ns));
+}
+
+void
+timer_cancel(struct timer *t)
+{
+	unsigned long flags = irq_save();
+	struct timer_heap *h = &this_cpu()->timers;
+	int was_first;
+
+	if (t->slot >= 0) {
+		was_first = t->slot == 0;
+		heap_remove(h, t);
+		if (was_first)
+			timer_program(h);
+	}
+	irq_restore(flags);
+}
+
+/* Called from apic_handler: run everything that has expired on this CPU */
+void
+timer_interrupt(void)
+{
+	struct timer_heap *h = &this_cpu()->timers;
+	struct timer *t;
+
+	while (h->size > 0 && h->heap[0]->deadline <= rdtsc()) {
+		t = h->heap[0];
+		heap_remove(h, t);
+		t->fn(t, t->data); /* may re-arm t */
+	}
+	timer_program(h);
+}
+
+/* TSC frequency from CPUID leaf 0x15 (or 0x16), 0 if unknown */
+static uint64_t
+timer_cpuid_tsc_hz(void)
+{
+	uint32_t eax, ebx, ecx, edx, max;
+
+	x86_cpuid(0, &max, &ebx, &ecx, &edx);
+	if (max >= 0x15) {
+		x86_cpuid(0x15, &eax, &ebx, &ecx, &edx);
+		if (eax != 0 && ebx != 0 && ecx != 0)
+			return (uint64_t) ecx * ebx / eax;
+	}
+	if (max >= 0x16) {
+		x86_cpuid(0x16, &eax, &ebx, &ecx, &edx);
+		if (eax != 0)
+			return (uint64_t) eax * 1000000;
+	}
+	return 0;
+}
+
+void
+timer_init(uint64_t hz)
+{
+	uint32_t eax, ebx, ecx, edx, elapsed;
+	uint64_t start;
+
+	tsc_hz = hz ? hz : timer_cpuid_tsc_hz();
+	if (tsc_hz == 0) {
+		printf("timer: unknown TSC frequency, timers disabled\n");
+		return;
+	}
+	ns_to_tsc_mult = (tsc_hz << TIMER_SHIFT) / 1000000000ULL;
+	tsc_to_ns_mult = (1000000000ULL << TIMER_SHIFT) / tsc_hz;
+
+	x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+	tsc_deadline = (ecx & (1U << 24)) != 0;
+
+	if (tsc_deadline) {
+		apic_timer_setup(TIMER_VECTOR, APIC_TIMER_TSC_DEADLINE);
+	} else {
+		/* Count LAPIC ticks over 10ms of TSC */
+		apic_timer_setup(TIMER_VECTOR, APIC_TIMER_ONESHOT | APIC_TIMER_MASKED);
+		start = rdtsc();
+		apic_timer_oneshot(0xFFFFFFFFU);
+		while (rdtsc() - start < tsc_hz / 100)
+			;
+		elapsed = 0xFFFFFFFFU - apic_timer_current();
+		apic_timer_oneshot(0);
+		tsc_to_lapic_mult = ((uint64_t) elapsed << TIMER_SHIFT) / (rdtsc() - start);
+		apic_timer_setup(TIMER_VECTOR, APIC_TIMER_ONESHOT);
+	}
+
+	printf("timer: TSC %d MHz, %s mode\n", (int) (tsc_hz / 1000000),
+		tsc_deadline ? "TSC-deadline" : "one-shot");
+}
+
+/* The calibration done on the boot CPU holds for all of them */
+void
+timer_init_cpu(void)
+{
+	if (tsc_hz == 0)
+		return;
+	apic_timer_setup(TIMER_VECTOR, tsc_deadline ?
+		APIC_TIMER_TSC_DEADLINE : APIC_TIMER_ONESHOT);
+}
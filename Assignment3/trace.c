@@ -0,0 +1,72 @@
+/*
+ * trace.c - per-CPU kernel event tracing
+ *
+ * Events (syscalls, faults, interrupts, context switches, hypercalls) are
+ * rdtsc-stamped 32-byte records in a per-CPU ring that is overwritten
+ * when full; recording one is a few stores and no locked instructions, so
+ * tracing stays on. SYS_trace_read copies a CPU's ring out for offline
+ * decoding, the TSC frequency is available through SYS_vclock_setup.
+ */
+
+#include <trace.h>
+#include <pmm.h>
+#include <kernel_syscall.h>
+
+_Static_assert((TRACE_ENTRIES & (TRACE_ENTRIES - 1)) == 0, "TRACE_ENTRIES must be a power of two");
+_Static_assert(sizeof(struct trace_event) == 32, "the trace ABI has 32-byte events");
+
+/* The ring itself, the event counter is in struct cpu */
+struct trace_event *trace_ring_alloc(void)
+{
+	size_t pages = TRACE_ENTRIES * sizeof(struct trace_event) / PAGE_SIZE;
+	struct trace_event *r = pmm_alloc_pages(pmm_order(pages));
+	unsigned int i;
+
+	if (!r)
+		return NULL;
+	for (i = 0; i < TRACE_ENTRIES; i++)
+		r[i].seq = TRACE_SEQ_BUSY;
+	return r;
+}
+
+/* Copy one event if it is complete and still event number 'seq' */
+static int trace_copy(struct trace_event *r, uint64_t seq, struct trace_event *out)
+{
+	struct trace_event *e = &r[seq & (TRACE_ENTRIES - 1)];
+	uint32_t before, after;
+
+	before = *(volatile uint32_t *) &e->seq;
+	__asm__ __volatile__ ("" ::: "memory");
+	*out = *e;
+	__asm__ __volatile__ ("" ::: "memory");
+	after = *(volatile uint32_t *) &e->seq;
+	out->seq = before;
+	return before == (uint32_t) seq && after == before;
+}
+
+static long sys_trace_read(long a1, long a2, long a3, long a4, long a5)
+{
+	struct trace_event *buf = (struct trace_event *) a2;
+	unsigned long num = (unsigned long) a3, n = 0;
+	uint64_t head, seq;
+
+	if ((unsigned long) a1 >= SMP_MAX_CPUS || !cpus[a1] || !cpus[a1]->trace)
+		return SYSCALL_EINVAL;
+	if (num > TRACE_ENTRIES)
+		num = TRACE_ENTRIES;
+	if (!user_range_writable(a2, num * sizeof(struct trace_event)))
+		return SYSCALL_EFAULT;
+
+	head = __atomic_load_n(&cpus[a1]->trace_head, __ATOMIC_ACQUIRE);
+	seq = head > num ? head - num : 0;
+	for (; seq != head; seq++) {
+		if (trace_copy(cpus[a1]->trace, seq, &buf[n]))
+			n++;
+	}
+	return n;
+}
+
+void trace_init(void)
+{
+	syscall_register(SYS_trace_read, sys_trace_read);
+}
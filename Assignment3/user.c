@@ -5,24 +5,139 @@
 
 #include <syscall.h>
 #include "userinc/syscall.h"
+#include "userinc/sysnr.h"
+#include "userinc/sysring.h"
+#include "userinc/vclock.h"
 typedef unsigned long long u64;
 
 __thread int a[100];
 
+static struct syscall_stat stats[NR_SYSCALLS];
+
+/* Append the decimal representation of 'num' to 'buf' */
+static char *append_num(char *buf, u64 num)
+{
+	char tmp[20];
+	int i = 0;
+
+	do {
+		tmp[i++] = '0' + num % 10;
+		num /= 10;
+	} while (num != 0);
+	while (i != 0)
+		*buf++ = tmp[--i];
+	return buf;
+}
+
+static char *append_str(char *buf, const char *str)
+{
+	while (*str != '\0')
+		*buf++ = *str++;
+	return buf;
+}
+
+static inline u64 rdtsc(void)
+{
+	unsigned int eax, edx;
+	__asm__ __volatile__("rdtsc" : "=a" (eax), "=d" (edx));
+	return ((u64) edx << 32) | eax;
+}
+
+/* Cycles per SYS_nop: one SYSCALL each vs. one batch through the ring */
+static void ring_benchmark(void)
+{
+	struct sysring *ring = sysring_setup(0);
+	struct sysring_cqe cqe;
+	char line[128], *cur;
+	u64 start, direct, batched;
+	int i;
+
+	if (!ring)
+		return;
+
+	start = rdtsc();
+	for (i = 0; i < SYSRING_ENTRIES; i++)
+		__syscall0(SYS_nop);
+	direct = (rdtsc() - start) / SYSRING_ENTRIES;
+
+	start = rdtsc();
+	for (i = 0; i < SYSRING_ENTRIES; i++)
+		sysring_submit(ring, SYS_nop, 0, 0, 0, 0, 0, i);
+	sysring_enter(ring);
+	while (sysring_reap(ring, &cqe)) {}
+	batched = (rdtsc() - start) / SYSRING_ENTRIES;
+
+	cur = append_str(line, "SYS_nop: ");
+	cur = append_num(cur, direct);
+	cur = append_str(cur, " cycles/call direct, ");
+	cur = append_num(cur, batched);
+	cur = append_str(cur, " cycles/call batched");
+	*cur = '\0';
+	__syscall1(SYS_print, (long)line);
+}
+
+/* Cycles per SYS_yield, i.e., a system call plus a switch to the next task */
+static void yield_benchmark(void)
+{
+	char line[128], *cur;
+	u64 start, cycles;
+	int i;
+
+	start = rdtsc();
+	for (i = 0; i < 1000; i++)
+		__syscall0(SYS_yield);
+	cycles = (rdtsc() - start) / 1000;
+
+	cur = append_str(line, "task ");
+	cur = append_num(cur, __syscall0(SYS_task_id));
+	cur = append_str(cur, ": ");
+	cur = append_num(cur, cycles);
+	cur = append_str(cur, " cycles/SYS_yield");
+	*cur = '\0';
+	__syscall1(SYS_print, (long)line);
+}
+
 void user_start(void)
 {
 	const char* msg = "System call 1\n";
 	const char* msg2 = "System call 2\n";
+	char line[128], *cur;
 	
-	__syscall1((long)1, (long)msg);
-	__syscall1((long)1, (long)msg2);
+	__syscall1(SYS_print, (long)msg);
+	__syscall1(SYS_print, (long)msg2);
 
 	for(int i=0; i<100; i++)
 	{
 		a[i]=i;
 	}
-	
 
+	//Per-syscall overhead, as accounted by the kernel
+	__syscall2(SYS_syscall_stats, (long)stats, NR_SYSCALLS);
+	cur = append_str(line, "SYS_print: ");
+	cur = append_num(cur, stats[SYS_print].calls);
+	cur = append_str(cur, " calls, ");
+	cur = append_num(cur, stats[SYS_print].cycles / stats[SYS_print].calls);
+	cur = append_str(cur, " cycles/call");
+	*cur = '\0';
+	__syscall1(SYS_print, (long)line);
+
+	ring_benchmark();
+
+	//Timestamps without entering the kernel
+	if (vclock_init() == 0)
+	{
+		int64_t t0 = vclock_monotonic();
+		int64_t t1 = vclock_monotonic();
+		cur = append_str(line, "vclock: wall clock ");
+		cur = append_num(cur, vclock_wall());
+		cur = append_str(cur, ", back-to-back reads ");
+		cur = append_num(cur, t1 - t0);
+		cur = append_str(cur, " ns apart");
+		*cur = '\0';
+		__syscall1(SYS_print, (long)line);
+	}
+
+	yield_benchmark();
 
 	while (1) {};
 }
@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+ * System call numbers and ABI structures,
+ * shared by the kernel (kernel_syscall.c) and user programs
+ */
+
+#define SYS_nop				0	/* () does nothing, for measurements */
+#define SYS_print			1	/* (const char *str) */
+#define SYS_syscall_stats	2	/* (struct syscall_stat *buf, unsigned long num) */
+#define SYS_ring_setup		3	/* (unsigned int flags), returns struct sysring * */
+#define SYS_ring_enter		4	/* (), returns the number of consumed entries */
+#define SYS_vclock_setup	5	/* (struct vclock_info *info) */
+#define SYS_yield			6	/* (), lets the next runnable task run */
+#define SYS_task_id			7	/* (), returns the caller's task id */
+#define SYS_trace_read		8	/* (unsigned int cpu, struct trace_event *buf, unsigned long num) */
+#define SYS_clock_monotonic	9	/* (), nanoseconds since boot */
+
+#define NR_SYSCALLS			64
+
+#define SYSCALL_ENOSYS		(-38L)	/* invalid system call number */
+#define SYSCALL_EFAULT		(-14L)	/* bad user pointer */
+#define SYSCALL_EBUSY		(-16L)	/* already set up */
+#define SYSCALL_ENOMEM		(-12L)	/* out of memory */
+#define SYSCALL_EINVAL		(-22L)	/* invalid argument */
+#define SYSCALL_EOPNOTSUPP	(-95L)	/* not available on this system */
+
+/* Per-syscall counters, indexed by the system call number */
+struct syscall_stat {
+	unsigned long long calls;
+	unsigned long long cycles;	/* total rdtsc cycles in the handler */
+};
+
+/*
+ * Batched system calls: a submission/completion ring in a page shared
+ * by the kernel and the user program (see sysring.c, userinc/sysring.h).
+ *
+ * The user program fills sq[sq_tail % SYSRING_ENTRIES] and advances sq_tail;
+ * the kernel consumes entries from sq_head, posts results to
+ * cq[cq_tail % SYSRING_ENTRIES] and advances sq_head and cq_tail.
+ * Indices are free-running 32-bit counters.
+ */
+#define SYSRING_ENTRIES		32
+
+/* SYS_ring_setup flags */
+#define SYSRING_SETUP_SQPOLL	0x1	/* drain the ring from a kernel timer */
+
+/* struct sysring flags */
+#define SYSRING_NEED_WAKEUP		0x1	/* the poller is off, use SYS_ring_enter */
+
+struct sysring_sqe {
+	unsigned long long n;			/* the system call number */
+	unsigned long long args[5];
+	unsigned long long user_data;	/* copied to the completion */
+	unsigned long long pad;
+};
+
+struct sysring_cqe {
+	long long res;					/* the return value */
+	unsigned long long user_data;
+};
+
+struct sysring {
+	volatile unsigned int sq_head;
+	volatile unsigned int sq_tail;
+	volatile unsigned int cq_head;
+	volatile unsigned int cq_tail;
+	volatile unsigned int flags;
+	unsigned int pad[11];
+	struct sysring_sqe sq[SYSRING_ENTRIES];
+	struct sysring_cqe cq[SYSRING_ENTRIES];
+};
+
+/*
+ * User-mapped clock: SYS_vclock_setup maps Xen's shared info page read-only
+ * into the user address space and returns where the PV clock structures
+ * are (see userinc/vclock.h). Only vCPU 0's record is exposed, which is
+ * valid on every CPU only while Xen reports a stable TSC: the call fails
+ * with SYSCALL_EOPNOTSUPP otherwise, and SYS_clock_monotonic reads the
+ * record of the CPU the caller runs on.
+ */
+struct vclock_info {
+	unsigned long long time_info;	/* struct pvclock_vcpu_time_info * */
+	unsigned long long wall_clock;	/* struct pvclock_wall_clock * */
+};
+
+/*
+ * Kernel tracing: every CPU records events in its own ring of
+ * TRACE_ENTRIES (see trace.c). SYS_trace_read copies out up to 'num' of the
+ * newest events of one CPU, oldest first, and returns how many; events
+ * that were overwritten meanwhile are left out, gaps show in 'seq'.
+ */
+#define TRACE_ENTRIES		4096
+
+#define TRACE_SYSCALL_ENTER	1	/* a1: number */
+#define TRACE_SYSCALL_EXIT	2	/* a1: number, a2: return value */
+#define TRACE_FAULT			3	/* a1: address, a2: error code */
+#define TRACE_IRQ			4	/* a1: vector */
+#define TRACE_SWITCH		5	/* a1: previous task id, a2: next task id */
+#define TRACE_HYPERCALL		6	/* a1: hypercall number, a2: first argument */
+
+struct trace_event {
+	unsigned long long tsc;		/* rdtsc at the event */
+	unsigned int seq;			/* per-CPU event number (low 32 bits) */
+	unsigned short type;
+	unsigned short cpu;
+	unsigned long long a1;
+	unsigned long long a2;
+};
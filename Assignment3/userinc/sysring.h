@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * Batched system calls (user side), see userinc/sysnr.h for the ring layout
+ *
+ * Queue requests with sysring_submit(), then call sysring_enter() once
+ * for the whole batch (unless the kernel polls the ring), and collect
+ * the results with sysring_reap().
+ */
+
+#include "syscall.h"
+#include "sysnr.h"
+
+#define sysring_barrier()	__asm__ __volatile__ ("" ::: "memory")
+
+/* Returns the ring, or NULL on failure */
+static __inline struct sysring *sysring_setup(unsigned int flags)
+{
+	long ret = __syscall1(SYS_ring_setup, flags);
+
+	if (ret < 0 && ret > -4096)
+		return (struct sysring *) 0;
+	return (struct sysring *) ret;
+}
+
+/* Returns 0, or -1 if the submission queue is full */
+static __inline int sysring_submit(struct sysring *ring, long n, long a1, long a2,
+								   long a3, long a4, long a5, unsigned long long user_data)
+{
+	unsigned int tail = ring->sq_tail;
+	struct sysring_sqe *sqe;
+
+	if (tail - ring->sq_head == SYSRING_ENTRIES)
+		return -1;
+	sqe = &ring->sq[tail % SYSRING_ENTRIES];
+	sqe->n = n;
+	sqe->args[0] = a1;
+	sqe->args[1] = a2;
+	sqe->args[2] = a3;
+	sqe->args[3] = a4;
+	sqe->args[4] = a5;
+	sqe->user_data = user_data;
+	sysring_barrier(); /* fill the entry before publishing it */
+	ring->sq_tail = tail + 1;
+	return 0;
+}
+
+/* Hands the queued requests to the kernel unless it polls the ring */
+static __inline long sysring_enter(struct sysring *ring)
+{
+	if (!(ring->flags & SYSRING_NEED_WAKEUP))
+		return 0;
+	return __syscall0(SYS_ring_enter);
+}
+
+/* Returns 1 and fills 'cqe' if a completion is available, 0 otherwise */
+static __inline int sysring_reap(struct sysring *ring, struct sysring_cqe *cqe)
+{
+	unsigned int head = ring->cq_head;
+
+	if (head == ring->cq_tail)
+		return 0;
+	sysring_barrier(); /* read the entry after cq_tail */
+	*cqe = ring->cq[head % SYSRING_ENTRIES];
+	sysring_barrier();
+	ring->cq_head = head + 1;
+	return 1;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+ * User-mapped PV clock: reads Xen's monotonic and wall clocks without
+ * entering the kernel, using the same version/rdtsc loop as the kernel
+ * (see _pvclock_monotonic() in kernel.c)
+ *
+ * Call vclock_init() once; it returns -1 if the clock is unavailable
+ * (e.g., not running on Xen, or the TSC is not synchronized across CPUs).
+ * Should Xen clear PVCLOCK_TSC_STABLE_BIT later, vclock_monotonic() falls
+ * back to SYS_clock_monotonic.
+ */
+
+#include "types.h"
+#include "syscall.h"
+#include "sysnr.h"
+
+struct pvclock_vcpu_time_info {
+	uint32_t version;
+	uint32_t pad0;
+	uint64_t tsc_timestamp;
+	uint64_t system_time;
+	uint32_t tsc_to_system_mul;
+	int8_t tsc_shift;
+	uint8_t flags;
+	uint8_t pad[2];
+} __attribute__((__packed__));
+
+#define PVCLOCK_TSC_STABLE_BIT	0x1	/* struct pvclock_vcpu_time_info flags */
+
+struct pvclock_wall_clock {
+	uint32_t version;
+	uint32_t sec;
+	uint32_t nsec;
+} __attribute__((__packed__));
+
+static volatile struct pvclock_vcpu_time_info *vclock_ti;
+static volatile struct pvclock_wall_clock *vclock_wc;
+
+static __inline int vclock_init(void)
+{
+	struct vclock_info info;
+
+	if (__syscall1(SYS_vclock_setup, (long) &info) != 0)
+		return -1;
+	vclock_ti = (volatile struct pvclock_vcpu_time_info *) info.time_info;
+	vclock_wc = (volatile struct pvclock_wall_clock *) info.wall_clock;
+	return 0;
+}
+
+static __inline uint64_t vclock_rdtsc(void)
+{
+	uint32_t eax, edx;
+	__asm__ __volatile__("rdtsc" : "=a" (eax), "=d" (edx));
+	return ((uint64_t) edx << 32) | eax;
+}
+
+static __inline uint64_t vclock_mul64_32(uint64_t a, uint32_t b)
+{
+	uint64_t prod;
+	__asm__(
+		"mul %%rdx ; "
+		"shrd $32, %%rdx, %%rax"
+		: "=a"(prod)
+		: "0"(a), "d"((uint64_t)b));
+	return prod;
+}
+
+/* Nanoseconds since boot */
+static __inline int64_t vclock_monotonic(void)
+{
+	uint32_t version;
+	uint64_t delta, time_now;
+
+	do {
+		version = vclock_ti->version;
+		__asm__("mfence" ::: "memory");
+		/* vCPU 0's record does not fit this CPU's TSC */
+		if (!(vclock_ti->flags & PVCLOCK_TSC_STABLE_BIT))
+			return __syscall0(SYS_clock_monotonic);
+		delta = vclock_rdtsc() - vclock_ti->tsc_timestamp;
+		if (vclock_ti->tsc_shift < 0)
+			delta >>= -vclock_ti->tsc_shift;
+		else
+			delta <<= vclock_ti->tsc_shift;
+		time_now = vclock_mul64_32(delta, vclock_ti->tsc_to_system_mul) +
+				   vclock_ti->system_time;
+		__asm__("mfence" ::: "memory");
+	} while ((vclock_ti->version & 1) || (vclock_ti->version != version));
+
+	return (int64_t) time_now;
+}
+
+/* Nanoseconds since the epoch */
+static __inline int64_t vclock_wall(void)
+{
+	uint32_t version;
+	int64_t wc_boot;
+
+	do {
+		version = vclock_wc->version;
+		__asm__("mfence" ::: "memory");
+		wc_boot = vclock_wc->sec * 1000000000LL;
+		wc_boot += vclock_wc->nsec;
+		__asm__("mfence" ::: "memory");
+	} while ((vclock_wc->version & 1) || (vclock_wc->version != version));
+
+	return wc_boot + vclock_monotonic();
+}
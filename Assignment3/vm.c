@@ -0,0 +1,313 @@
+/*
+ * vm.c - page table management and demand paging
+ */
+
+#include <vm.h>
+#include <pmm.h>
+#include <cpuid.h>
+#include <printf.h>
+#include <msr.h>
+
+int vm_has_pcid;
+static uint64_t vm_cr4_bits; /* what vm_init_tlb() enabled, for the APs */
+
+/*
+ * The power-on PAT is WB, WT, UC-, UC (twice); entry 1 becomes WC, which
+ * nothing used before (PWT is never set otherwise). Every CPU needs the same
+ * PAT.
+ */
+#define PAT_WC_ENTRY1	0x0007040600070106ULL
+
+#define CR0_NW			(1ULL << 29)
+#define CR0_CD			(1ULL << 30)
+
+static inline uint64_t read_cr0(void)
+{
+	uint64_t cr0;
+
+	__asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+	return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0)
+{
+	__asm__ __volatile__ ("mov %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+static inline void wbinvd(void)
+{
+	__asm__ __volatile__ ("wbinvd" ::: "memory");
+}
+
+/* Drop every TLB entry of every PCID, global ones included */
+static void vm_flush_tlb_all(void)
+{
+	uint64_t cr4 = read_cr4();
+
+	if (cr4 & CR4_PGE) {
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+	} else {
+		/* No global entries; only called at boot, before other PCIDs are used */
+		__asm__ __volatile__ ("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+	}
+}
+
+/*
+ * Intel SDM 11.12.4 (with the procedure of 11.11.8): the PAT changes with
+ * caching disabled, between cache write-backs and TLB flushes, so that no
+ * line or translation cached with the old memory type survives
+ */
+static void vm_init_pat(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	unsigned long flags;
+	uint64_t cr0;
+
+	x86_cpuid(0x1, &eax, &ebx, &ecx, &edx);
+	if (!(edx & (1U << 16))) /* PAT */
+		return;
+
+	__asm__ __volatile__("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	cr0 = read_cr0();
+	write_cr0((cr0 | CR0_CD) & ~CR0_NW);
+	wbinvd();
+	vm_flush_tlb_all();
+	wrmsr(MSR_PAT, PAT_WC_ENTRY1);
+	wbinvd();
+	vm_flush_tlb_all();
+	write_cr0(cr0);
+	__asm__ __volatile__("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
+}
+
+void vm_init_tlb(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t cr4 = read_cr4();
+
+	x86_cpuid(0x1, &eax, &ebx, &ecx, &edx);
+	if (edx & (1U << 13)) /* PGE */
+		cr4 |= CR4_PGE;
+	if (ecx & (1U << 17)) /* PCID */
+		vm_has_pcid = 1;
+
+	/* CR3 must refer to PCID 0 when enabling PCIDs */
+	if (vm_has_pcid)
+		cr4 |= CR4_PCIDE;
+	write_cr4(cr4);
+	vm_cr4_bits = cr4 & (CR4_PGE | CR4_PCIDE);
+	vm_init_pat();
+
+	printf("Global pages %s, PCID %s\n",
+		(cr4 & CR4_PGE) ? "on" : "off", vm_has_pcid ? "on" : "off");
+}
+
+/* Application processors use the same features as the boot CPU */
+void vm_init_tlb_ap(void)
+{
+	write_cr4(read_cr4() | vm_cr4_bits);
+	vm_init_pat();
+}
+
+/*
+ * Mappings are only ever added (vm_fault() fills not-present entries and
+ * flushes that one page), so a PCID's cached entries stay valid on every
+ * CPU; anything that removes or downgrades mappings will have to
+ * invalidate them on all CPUs first.
+ */
+void vm_load_cr3(uint64_t *pml4, unsigned int pcid, int noflush)
+{
+	uint64_t cr3 = (uint64_t) pml4;
+
+	if (vm_has_pcid) {
+		cr3 |= pcid;
+		if (noflush)
+			cr3 |= CR3_NOFLUSH;
+	}
+	__asm__ __volatile__ ("mov %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+static inline unsigned int pt_index(uint64_t va, unsigned int level)
+{
+	return (va >> (12 + 9 * level)) & 511;
+}
+
+uint64_t *vm_walk(uint64_t *pml4, uint64_t va, int alloc)
+{
+	uint64_t *table = pml4;
+	unsigned int level;
+
+	for (level = 3; level != 0; level--) {
+		uint64_t *entry = &table[pt_index(va, level)];
+		if (!(*entry & PTE_P)) {
+			uint64_t *next;
+			if (!alloc)
+				return NULL;
+			next = pmm_alloc_zeroed_page();
+			if (!next)
+				return NULL;
+			/* Permissions are enforced at the last level */
+			*entry = (uint64_t) next | PTE_P | PTE_W | PTE_U;
+		} else if (*entry & PTE_PS) {
+			return NULL; /* large pages are kernel-only */
+		}
+		table = (uint64_t *) (*entry & PTE_ADDR_MASK);
+	}
+
+	return &table[pt_index(va, 0)];
+}
+
+int vm_map_page(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t flags)
+{
+	uint64_t *pte = vm_walk(pml4, va, 1);
+
+	if (!pte)
+		return -1;
+	*pte = (pa & PTE_ADDR_MASK) | flags | PTE_P;
+	return 0;
+}
+
+/* Replace the large page at 'entry' (a level 1 or 2 entry) by a table of smaller pages */
+static int vm_split(uint64_t *entry, unsigned int level)
+{
+	uint64_t size = 1ULL << (12 + 9 * level), step = size >> 9;
+	uint64_t base = *entry & PTE_ADDR_MASK & ~(size - 1);
+	uint64_t flags = *entry & ~PTE_ADDR_MASK;
+	uint64_t *table = pmm_alloc_page();
+	unsigned int i;
+
+	if (!table)
+		return -1;
+	if (level == 1) {
+		/* 4KB pages: no PS bit, and the PAT bit moves */
+		flags &= ~PTE_PS;
+		if (*entry & PTE_PAT_LARGE)
+			flags |= PTE_PAT;
+	} else if (*entry & PTE_PAT_LARGE) {
+		flags |= PTE_PAT_LARGE;
+	}
+	for (i = 0; i < 512; i++)
+		table[i] = (base + i * step) | flags;
+	*entry = (uint64_t) table | PTE_P | PTE_W;
+	return 0;
+}
+
+/* Give the page at 'va' the cache type, *size is then the size of that page */
+static int vm_set_cache_page(uint64_t *pml4, uint64_t va, uint64_t end,
+	uint64_t cache, uint64_t *size)
+{
+	uint64_t *table = pml4, *entry;
+	unsigned int level;
+
+	for (level = 3; ; level--) {
+		entry = &table[pt_index(va, level)];
+		*size = 1ULL << (12 + 9 * level);
+		if (!(*entry & PTE_P))
+			return -1;
+		if (level == 0)
+			break;
+		if (*entry & PTE_PS) {
+			/* A large page inside the range keeps its size */
+			if (!(va & (*size - 1)) && va + *size <= end)
+				break;
+			if (vm_split(entry, level) != 0)
+				return -1;
+		}
+		table = (uint64_t *) (*entry & PTE_ADDR_MASK);
+	}
+	*entry = (*entry & ~(PTE_PWT | PTE_PCD)) | cache;
+	return 0;
+}
+
+int vm_set_cache(uint64_t *pml4, uint64_t start, uint64_t end, uint64_t cache)
+{
+	uint64_t va, size;
+	int ret = 0;
+
+	for (va = start & PTE_ADDR_MASK; va < end; va += size) {
+		ret = vm_set_cache_page(pml4, va, end, cache, &size);
+		if (ret != 0)
+			break;
+	}
+
+	wbinvd();
+	vm_flush_tlb_all();
+	return ret;
+}
+
+int vm_add_region(struct vm_space *vs, uint64_t start, uint64_t end, uint64_t flags)
+{
+	struct vm_region *r;
+
+	if (vs->nr_regions == VM_MAX_REGIONS)
+		return -1;
+	r = &vs->regions[vs->nr_regions++];
+	r->start = start & PTE_ADDR_MASK;
+	r->end = end;
+	r->flags = flags;
+	return 0;
+}
+
+static struct vm_region *vm_find_region(struct vm_space *vs, uint64_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < vs->nr_regions; i++) {
+		struct vm_region *r = &vs->regions[i];
+		/* 'end - 1' handles regions that end at the top of the address space */
+		if (addr >= r->start && addr <= r->end - 1)
+			return r;
+	}
+	return NULL;
+}
+
+int vm_user_access(struct vm_space *vs, uint64_t start, uint64_t size, uint64_t flags)
+{
+	uint64_t va, last = (start + size - 1) & PTE_ADDR_MASK;
+	uint64_t *pte;
+	struct vm_region *r;
+
+	if (size == 0)
+		return 1;
+	for (va = start & PTE_ADDR_MASK; ; va += PAGE_SIZE) {
+		pte = vm_walk(vs->pml4, va, 0);
+		if (pte && (*pte & PTE_P)) {
+			if ((*pte & flags) != flags)
+				return 0;
+		} else {
+			/* vm_fault() will populate it with the region's flags */
+			r = vm_find_region(vs, va);
+			if (!r || (r->flags & flags) != flags)
+				return 0;
+		}
+		if (va == last)
+			return 1;
+	}
+}
+
+int vm_fault(struct vm_space *vs, uint64_t addr, unsigned int error)
+{
+	struct vm_region *r;
+	uint64_t va = addr & PTE_ADDR_MASK;
+	void *page;
+
+	/* Only not-present pages are populated on demand */
+	if (error & PF_P)
+		return -1;
+
+	r = vm_find_region(vs, addr);
+	if (!r || ((error & PF_W) && !(r->flags & PTE_W)))
+		return -1;
+
+	page = pmm_alloc_zeroed_page();
+	if (!page)
+		return -1;
+	if (vm_map_page(vs->pml4, va, (uint64_t) page, r->flags) != 0) {
+		pmm_free_page(page);
+		return -1;
+	}
+
+	/* A full CR3 reload is not needed, only this entry may be stale */
+	invlpg(va);
+	return 0;
+}